@@ -387,48 +387,115 @@ void CAddrMan::Attempt_(const CService &addr, int64 nTime)
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddress CAddrManSnapshot::Select(int nUnkBias) const
 {
-    if (size() == 0)
+    if (vInfo.empty())
         return CAddress();
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    const std::vector<std::vector<int> > &vvBuckets = ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried) ? vvTried : vvNew;
+
+    // pick a random entry of a random bucket, favouring the more promising ones
+    double fChanceFactor = 1.0;
+    while(1)
     {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
+        const std::vector<int> &vBucket = vvBuckets[GetRandInt(vvBuckets.size())];
+        if (vBucket.size() == 0) continue;
+        const CAddrInfo &info = vInfo[vBucket[GetRandInt(vBucket.size())]];
+        if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
+            return info;
+        fChanceFactor *= 1.2;
+    }
+}
+
+void CAddrManSnapshot::GetAddr(std::vector<CAddress> &vAddr) const
+{
+    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vInfo.size()/100;
+    if (nNodes > ADDRMAN_GETADDR_MAX)
+        nNodes = ADDRMAN_GETADDR_MAX;
+
+    // perform a random shuffle over the first nNodes positions (selecting from all)
+    std::vector<int> vPos(vInfo.size());
+    for (unsigned int n = 0; n < vPos.size(); n++)
+        vPos[n] = n;
+    vAddr.reserve(nNodes);
+    for (int n = 0; n<nNodes; n++)
+    {
+        int nRndPos = GetRandInt(vPos.size() - n) + n;
+        std::swap(vPos[n], vPos[nRndPos]);
+        vAddr.push_back(vInfo[vPos[n]]);
+    }
+}
+
+CAddrManSnapshot* CAddrMan::CreateSnapshot_() const
+{
+    CAddrManSnapshot* pSnap = new CAddrManSnapshot();
+    pSnap->nKey = nKey;
+    pSnap->nTried = nTried;
+    pSnap->nNew = nNew;
+    pSnap->nTimeTaken = GetTimeMillis();
+
+    std::map<int, int> mapPos;
+    pSnap->vInfo.reserve(mapInfo.size());
+    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    {
+        mapPos[(*it).first] = pSnap->vInfo.size();
+        pSnap->vInfo.push_back((*it).second);
+    }
+
+    pSnap->vvTried.resize(vvTried.size());
+    for (unsigned int b = 0; b < vvTried.size(); b++)
+    {
+        pSnap->vvTried[b].reserve(vvTried[b].size());
+        for (std::vector<int>::const_iterator it = vvTried[b].begin(); it != vvTried[b].end(); it++)
+            pSnap->vvTried[b].push_back(mapPos[*it]);
+    }
+    pSnap->vvNew.resize(vvNew.size());
+    for (unsigned int b = 0; b < vvNew.size(); b++)
+    {
+        pSnap->vvNew[b].reserve(vvNew[b].size());
+        for (std::set<int>::const_iterator it = vvNew[b].begin(); it != vvNew[b].end(); it++)
+            pSnap->vvNew[b].push_back(mapPos[*it]);
     }
+    return pSnap;
+}
+
+CAddrManSnapshotPtr CAddrMan::GetSnapshot(bool fFresh) const
+{
+    CAddrManSnapshotPtr pSnap;
+    bool fChanged;
+    {
+        LOCK(cs_snapshot);
+        pSnap = pSnapshot;
+        fChanged = fDirty;
+    }
+    if (pSnap && !fFresh && (!fChanged || GetTimeMillis() - pSnap->nTimeTaken < ADDRMAN_SNAPSHOT_INTERVAL_MS))
+        return pSnap;
+
+    if (pSnap && !fFresh)
+    {
+        // Someone is changing the tables; the snapshot we have will do
+        TRY_LOCK(cs, lockTables);
+        if (!lockTables)
+            return pSnap;
+        pSnap.reset(CreateSnapshot_());
+        PublishSnapshot(pSnap);
+    }
+    else
+    {
+        LOCK(cs);
+        pSnap.reset(CreateSnapshot_());
+        PublishSnapshot(pSnap);
+    }
+    return pSnap;
+}
+
+void CAddrMan::PublishSnapshot(const CAddrManSnapshotPtr& pSnap) const
+{
+    LOCK(cs_snapshot);
+    pSnapshot = pSnap;
+    fDirty = false;
 }
 
 #ifdef DEBUG_ADDRMAN
@@ -491,38 +558,26 @@ int CAddrMan::Check_()
 }
 #endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
-{
-    int nNodes = ADDRMAN_GETADDR_MAX_PCT*vRandom.size()/100;
-    if (nNodes > ADDRMAN_GETADDR_MAX)
-        nNodes = ADDRMAN_GETADDR_MAX;
-
-    // perform a random shuffle over the first nNodes elements of vRandom (selecting from all)
-    for (int n = 0; n<nNodes; n++)
-    {
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
-    }
-}
-
-void CAddrMan::Connected_(const CService &addr, int64 nTime)
+bool CAddrMan::Connected_(const CService &addr, int64 nTime)
 {
     CAddrInfo *pinfo = Find(addr);
 
     // if not found, bail out
     if (!pinfo)
-        return;
+        return false;
 
     CAddrInfo &info = *pinfo;
 
     // check whether we are talking about the exact same CService (including same port)
     if (info != addr)
-        return;
+        return false;
 
     // update info
     int64 nUpdateInterval = 20 * 60;
     if (nTime - info.nTime > nUpdateInterval)
+    {
         info.nTime = nTime;
+        return true;
+    }
+    return false;
 }
@@ -13,6 +13,8 @@
 #include <map>
 #include <vector>
 
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 
@@ -42,6 +44,7 @@ private:
     int nRandomPos;
 
     friend class CAddrMan;
+    friend class CAddrManSnapshot;
 
 public:
 
@@ -161,6 +164,122 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// maximum number of changes remembered between two peers.dat dumps
+#define ADDRMAN_JOURNAL_MAX 100000
+
+// minimum age of an address manager snapshot before a change triggers a new one
+#define ADDRMAN_SNAPSHOT_INTERVAL_MS 1000
+
+// number of addresses added per lock acquisition when adding many at once
+#define ADDRMAN_ADD_BATCH 100
+
+/** Immutable copy of the address tables.
+ *
+ * Connection selection, getaddr replies and peers.dat dumps work from a
+ * snapshot instead of the live tables, so they never wait on (or hold up)
+ * the address manager lock. Entries are stored in nId order and buckets
+ * refer to them by position.
+ */
+class CAddrManSnapshot
+{
+public:
+    std::vector<unsigned char> nKey;
+    std::vector<CAddrInfo> vInfo;
+    std::vector<std::vector<int> > vvTried;
+    std::vector<std::vector<int> > vvNew;
+    int nTried;
+    int nNew;
+    int64 nTimeTaken; // milliseconds
+
+    CAddrManSnapshot() : nTried(0), nNew(0), nTimeTaken(0) {}
+
+    // Same on-disk format as CAddrMan, which is what reads it back
+    IMPLEMENT_SERIALIZE
+    (({
+        if (!fRead)
+        {
+            unsigned char nVersion = 0;
+            READWRITE(nVersion);
+            READWRITE(nKey);
+            READWRITE(nNew);
+            READWRITE(nTried);
+            int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
+            READWRITE(nUBuckets);
+            std::vector<int> vNewIndex(vInfo.size(), 0);
+            int nIds = 0;
+            for (unsigned int i = 0; i < vInfo.size() && nIds < nNew; i++)
+            {
+                vNewIndex[i] = nIds;
+                if (vInfo[i].nRefCount)
+                {
+                    READWRITE(vInfo[i]);
+                    nIds++;
+                }
+            }
+            nIds = 0;
+            for (unsigned int i = 0; i < vInfo.size() && nIds < nTried; i++)
+            {
+                if (vInfo[i].fInTried)
+                {
+                    READWRITE(vInfo[i]);
+                    nIds++;
+                }
+            }
+            for (unsigned int b = 0; b < vvNew.size(); b++)
+            {
+                int nSize = vvNew[b].size();
+                READWRITE(nSize);
+                for (unsigned int n = 0; n < vvNew[b].size(); n++)
+                {
+                    int nIndex = vNewIndex[vvNew[b][n]];
+                    READWRITE(nIndex);
+                }
+            }
+        }
+    });)
+
+    // Choose an address to connect to, as CAddrMan::Select.
+    CAddress Select(int nUnkBias) const;
+
+    // Return a bunch of addresses, selected at random.
+    void GetAddr(std::vector<CAddress> &vAddr) const;
+};
+
+typedef boost::shared_ptr<const CAddrManSnapshot> CAddrManSnapshotPtr;
+
+/** One change to the address tables, as appended to the peers.log journal.
+ *  Replaying the changes through CAddrMan's public interface rebuilds the
+ *  tables up to the random choices it makes along the way. */
+class CAddrManLogEntry
+{
+public:
+    enum
+    {
+        ADD,
+        GOOD,
+        ATTEMPT,
+        CONNECTED,
+    };
+
+    unsigned char nOp;
+    CAddress addr;
+    CNetAddr source;   // ADD only
+    int64 nTime;       // time penalty for ADD
+
+    CAddrManLogEntry() : nOp(ADD), nTime(0) {}
+    CAddrManLogEntry(unsigned char nOpIn, const CAddress& addrIn, const CNetAddr& sourceIn, int64 nTimeIn) :
+        nOp(nOpIn), addr(addrIn), source(sourceIn), nTime(nTimeIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nOp);
+        READWRITE(addr);
+        if (nOp == ADD)
+            READWRITE(source);
+        READWRITE(nTime);
+    )
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -195,6 +314,31 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // current snapshot, and whether the tables changed since it was taken;
+    // both require cs_snapshot. fDirty is only changed while also holding cs.
+    mutable CCriticalSection cs_snapshot;
+    mutable CAddrManSnapshotPtr pSnapshot;
+    mutable bool fDirty;
+
+    // requires cs
+    void MarkDirty()
+    {
+        LOCK(cs_snapshot);
+        fDirty = true;
+    }
+
+    // changes since the journal was last taken
+    std::vector<CAddrManLogEntry> vJournal;
+    bool fJournalOverflow;
+
+    void Journal(unsigned char nOp, const CAddress& addr, const CNetAddr& source, int64 nTime)
+    {
+        if (vJournal.size() >= ADDRMAN_JOURNAL_MAX)
+            fJournalOverflow = true;
+        else
+            vJournal.push_back(CAddrManLogEntry(nOp, addr, source, nTime));
+    }
+
 protected:
 
     // Find an entry.
@@ -228,20 +372,19 @@ protected:
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64 nTime);
 
-    // Select an address to connect to.
-    // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
+    // Copy the tables into a new snapshot.
+    CAddrManSnapshot* CreateSnapshot_() const;
+
+    // Make pSnap the current snapshot of unchanged tables. Requires cs.
+    void PublishSnapshot(const CAddrManSnapshotPtr& pSnap) const;
 
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
     int Check_();
 #endif
 
-    // Select several addresses at once.
-    void GetAddr_(std::vector<CAddress> &vAddr);
-
-    // Mark an entry as currently-connected-to.
-    void Connected_(const CService &addr, int64 nTime);
+    // Mark an entry as currently-connected-to. Returns whether it changed.
+    bool Connected_(const CService &addr, int64 nTime);
 
 public:
 
@@ -318,6 +461,9 @@ public:
             } else {
                 int nUBuckets = 0;
                 READWRITE(nUBuckets);
+                am->MarkDirty();
+                am->vJournal.clear();
+                am->fJournalOverflow = false;
                 am->nIdCount = 0;
                 am->mapInfo.clear();
                 am->mapAddr.clear();
@@ -387,6 +533,67 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         fDirty = true;
+         fJournalOverflow = false;
+    }
+
+    // Forget all addresses, as after reading a corrupt peers.dat.
+    void Clear()
+    {
+        LOCK(cs);
+        nKey.resize(32);
+        RAND_bytes(&nKey[0], 32);
+        nIdCount = 0;
+        mapInfo.clear();
+        mapAddr.clear();
+        vRandom.clear();
+        nTried = 0;
+        vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
+        nNew = 0;
+        vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
+        MarkDirty();
+        vJournal.clear();
+        fJournalOverflow = false;
+    }
+
+    // Hand over the changes made since the last call. Returns false if more
+    // happened than the journal could hold; then only a full dump is complete.
+    bool TakeJournal(std::vector<CAddrManLogEntry>& vEntries)
+    {
+        LOCK(cs);
+        vEntries.clear();
+        vEntries.swap(vJournal);
+        bool fComplete = !fJournalOverflow;
+        fJournalOverflow = false;
+        return fComplete;
+    }
+
+    // Take a fresh snapshot for a full dump and drop the journal, whose
+    // changes are all in the snapshot.
+    CAddrManSnapshotPtr TakeDumpSnapshot()
+    {
+        LOCK(cs);
+        vJournal.clear();
+        fJournalOverflow = false;
+        return GetSnapshot(true);
+    }
+
+    // Apply changes read back from the journal.
+    void Replay(const std::vector<CAddrManLogEntry>& vEntries)
+    {
+        BOOST_FOREACH(const CAddrManLogEntry& entry, vEntries)
+        {
+            switch (entry.nOp)
+            {
+            case CAddrManLogEntry::ADD:       Add(entry.addr, entry.source, entry.nTime); break;
+            case CAddrManLogEntry::GOOD:      Good(entry.addr, entry.nTime); break;
+            case CAddrManLogEntry::ATTEMPT:   Attempt(entry.addr, entry.nTime); break;
+            case CAddrManLogEntry::CONNECTED: Connected(entry.addr, entry.nTime); break;
+            }
+        }
+        // already on disk
+        LOCK(cs);
+        vJournal.clear();
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -416,6 +623,11 @@ public:
             LOCK(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
+            if (fRet)
+            {
+                MarkDirty();
+                Journal(CAddrManLogEntry::ADD, addr, source, nTimePenalty);
+            }
             Check();
         }
         if (fRet)
@@ -427,11 +639,23 @@ public:
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64 nTimePenalty = 0)
     {
         int nAdd = 0;
+        // Take the lock per batch, so a big addr message doesn't hold up
+        // connection bookkeeping for its whole length
+        for (unsigned int nBatch = 0; nBatch < vAddr.size(); nBatch += ADDRMAN_ADD_BATCH)
         {
             LOCK(cs);
             Check();
-            for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-                nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            unsigned int nEnd = std::min((unsigned int)vAddr.size(), nBatch + ADDRMAN_ADD_BATCH);
+            for (unsigned int i = nBatch; i < nEnd; i++)
+            {
+                if (Add_(vAddr[i], source, nTimePenalty))
+                {
+                    Journal(CAddrManLogEntry::ADD, vAddr[i], source, nTimePenalty);
+                    nAdd++;
+                }
+            }
+            if (nAdd > 0)
+                MarkDirty();
             Check();
         }
         if (nAdd)
@@ -446,6 +670,8 @@ public:
             LOCK(cs);
             Check();
             Good_(addr, nTime);
+            MarkDirty();
+            Journal(CAddrManLogEntry::GOOD, CAddress(addr), CNetAddr(), nTime);
             Check();
         }
     }
@@ -457,34 +683,29 @@ public:
             LOCK(cs);
             Check();
             Attempt_(addr, nTime);
+            MarkDirty();
+            Journal(CAddrManLogEntry::ATTEMPT, CAddress(addr), CNetAddr(), nTime);
             Check();
         }
     }
 
+    // Return a snapshot of the tables. Unless fFresh is set this may be a
+    // little out of date: an old snapshot is only replaced when the tables
+    // changed, and not while someone else holds the lock.
+    CAddrManSnapshotPtr GetSnapshot(bool fFresh = false) const;
+
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
     CAddress Select(int nUnkBias = 50)
     {
-        CAddress addrRet;
-        {
-            LOCK(cs);
-            Check();
-            addrRet = Select_(nUnkBias);
-            Check();
-        }
-        return addrRet;
+        return GetSnapshot()->Select(nUnkBias);
     }
 
     // Return a bunch of addresses, selected at random.
     std::vector<CAddress> GetAddr()
     {
-        Check();
         std::vector<CAddress> vAddr;
-        {
-            LOCK(cs);
-            GetAddr_(vAddr);
-        }
-        Check();
+        GetSnapshot()->GetAddr(vAddr);
         return vAddr;
     }
 
@@ -494,7 +715,11 @@ public:
         {
             LOCK(cs);
             Check();
-            Connected_(addr, nTime);
+            if (Connected_(addr, nTime))
+            {
+                MarkDirty();
+                Journal(CAddrManLogEntry::CONNECTED, CAddress(addr), CNetAddr(), nTime);
+            }
             Check();
         }
     }
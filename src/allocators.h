@@ -9,6 +9,9 @@
 #include <string>
 #include <boost/thread/mutex.hpp>
 #include <map>
+#include <vector>
+#include <limits>
+#include <new>
 #include <openssl/crypto.h> // for OPENSSL_cleanse()
 
 #ifdef WIN32
@@ -265,6 +268,126 @@ struct zero_after_free_allocator : public std::allocator<T>
     }
 };
 
+/**
+ * Monotonic memory arena for short-lived allocations that all die together,
+ * such as the temporaries built while connecting a single block.
+ *
+ * Memory is carved out of large chunks and is only given back when the arena
+ * is Reset() or destroyed, so anything allocated from it must be gone by then.
+ * Not thread-safe: an arena belongs to the thread that fills it.
+ */
+class CArena
+{
+private:
+    std::vector<char*> vChunks;
+    size_t nChunkSize;
+    size_t nChunkUsed;    // bytes handed out from vChunks.back()
+    size_t nAllocations;
+    size_t nBytes;
+
+    CArena(const CArena&);
+    CArena& operator=(const CArena&);
+
+public:
+    explicit CArena(size_t nChunkSizeIn = 64 * 1024) :
+        nChunkSize(nChunkSizeIn), nChunkUsed(nChunkSizeIn), nAllocations(0), nBytes(0) {}
+
+    ~CArena()
+    {
+        Reset();
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        // keep every allocation 16-byte aligned
+        nSize = (nSize + 15) & ~(size_t)15;
+        nAllocations++;
+        nBytes += nSize;
+        if (nSize > nChunkSize / 4)
+        {
+            // oversized requests get a chunk of their own, leaving the current one in use
+            char* pch = new char[nSize];
+            vChunks.insert(vChunks.empty() ? vChunks.end() : vChunks.end() - 1, pch);
+            if (vChunks.size() == 1)
+                nChunkUsed = nChunkSize;
+            return pch;
+        }
+        if (nChunkUsed + nSize > nChunkSize)
+        {
+            vChunks.push_back(new char[nChunkSize]);
+            nChunkUsed = 0;
+        }
+        void* p = vChunks.back() + nChunkUsed;
+        nChunkUsed += nSize;
+        return p;
+    }
+
+    void Reset()
+    {
+        for (unsigned int i = 0; i < vChunks.size(); i++)
+            delete[] vChunks[i];
+        vChunks.clear();
+        nChunkUsed = nChunkSize;
+        nAllocations = 0;
+        nBytes = 0;
+    }
+
+    size_t GetAllocations() const { return nAllocations; }
+    size_t GetBytes() const { return nBytes; }
+    size_t GetChunks() const { return vChunks.size(); }
+};
+
+//
+// Allocator that takes its memory from a CArena, or from the
+// heap when default constructed (no arena).
+//
+template<typename T>
+struct arena_allocator
+{
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef T value_type;
+    template<typename _Other> struct rebind
+    { typedef arena_allocator<_Other> other; };
+
+    CArena* parena;
+
+    arena_allocator() throw() : parena(NULL) {}
+    explicit arena_allocator(CArena* parenaIn) throw() : parena(parenaIn) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& a) throw() : parena(a.parena) {}
+    ~arena_allocator() throw() {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    size_type max_size() const throw() { return std::numeric_limits<size_type>::max() / sizeof(T); }
+    void construct(pointer p, const T& val) { new((void*)p) T(val); }
+    void destroy(pointer p) { p->~T(); }
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        if (parena == NULL)
+            return std::allocator<T>().allocate(n);
+        return (T*)parena->Allocate(sizeof(T) * n);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        // arena memory is released all at once by its owner
+        if (parena == NULL)
+            std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.parena == b.parena; }
+template<typename T, typename U>
+inline bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.parena != b.parena; }
+
 // This is exactly like std::string, but with a custom allocator.
 typedef std::basic_string<char, std::char_traits<char>, secure_allocator<char> > SecureString;
 
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "bloom.h"
+#include "hash.h"
 #include "main.h"
 #include "script.h"
 
@@ -180,3 +181,68 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate) :
+nCurrent(0),
+nEntriesPerGeneration(max(nElements / 2, 1u)),
+nEntriesThisGeneration(0),
+// Each generation holds half the elements at half the fp rate, so that
+// checking both stays within nFPRate
+nHashFuncs(max(min((unsigned int)(-log(nFPRate / 2) / LN2 + 0.5), MAX_HASH_FUNCS), 1u))
+{
+    unsigned int nBits = max((unsigned int)(-1 / LN2SQUARED * nEntriesPerGeneration * log(nFPRate / 2)), 64u);
+    vData[0].resize((nBits + 7) / 8);
+    vData[1].resize((nBits + 7) / 8);
+    reset();
+}
+
+bool CRollingBloomFilter::contains(unsigned int nGeneration, uint64 nHash) const
+{
+    const vector<unsigned char>& vBits = vData[nGeneration];
+    unsigned int nBits = vBits.size() * 8;
+    // Double hashing: bit i is h1 + i * h2
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32) | 1;
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = (h1 + i * h2) % nBits;
+        if (!(vBits[nIndex >> 3] & bit_mask[7 & nIndex]))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nCurrent ^= 1;
+        fill(vData[nCurrent].begin(), vData[nCurrent].end(), 0);
+        nEntriesThisGeneration = 0;
+    }
+    nEntriesThisGeneration++;
+
+    uint64 nHash = SipHashUint256(nKey0, nKey1, hash);
+    vector<unsigned char>& vBits = vData[nCurrent];
+    unsigned int nBits = vBits.size() * 8;
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32) | 1;
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nIndex = (h1 + i * h2) % nBits;
+        vBits[nIndex >> 3] |= bit_mask[7 & nIndex];
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    uint64 nHash = SipHashUint256(nKey0, nKey1, hash);
+    return contains(nCurrent, nHash) || contains(nCurrent ^ 1, nHash);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nKey0 = GetRand(std::numeric_limits<uint64>::max());
+    nKey1 = GetRand(std::numeric_limits<uint64>::max());
+    fill(vData[0].begin(), vData[0].end(), 0);
+    fill(vData[1].begin(), vData[1].end(), 0);
+    nEntriesThisGeneration = 0;
+}
@@ -88,4 +88,36 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter remembers roughly the last nElements hashes inserted
+ * into it, with a false positive rate around nFPRate.
+ *
+ * It is made of two generations of bits. Once the current generation has
+ * taken nElements / 2 hashes the older one is wiped and becomes current, so
+ * memory stays fixed and there is no per-item allocation. Hashes are mapped
+ * to bits with a single keyed SipHash, which makes it cheap enough to check
+ * for every inventory item sent to every peer.
+ */
+class CRollingBloomFilter
+{
+private:
+    std::vector<unsigned char> vData[2];
+    unsigned int nCurrent;
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nHashFuncs;
+    uint64 nKey0, nKey1;
+
+    bool contains(unsigned int nGeneration, uint64 nHash) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    // Forget everything, and pick new keys
+    void reset();
+};
+
 #endif /* XFUEL_BLOOM_H */
@@ -24,6 +24,14 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <ifaddrs.h>
+#include <sys/uio.h>
+#ifdef __linux__
+// Drive sockets from an epoll event loop instead of select()
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
 #endif
 
 typedef u_int SOCKET;
@@ -44,6 +44,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    nWriteHandlesClosed = 0;
 }
 
 CDBEnv::~CDBEnv()
@@ -213,9 +214,20 @@ void CDBEnv::CheckpointLSN(std::string strFile)
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
+// Writes are committed without syncing the log (DB_TXN_WRITE_NOSYNC); this
+// makes everything committed so far durable with a single fsync.
+void CDBEnv::SyncLog()
+{
+    if (!fDbEnvInit)
+        return;
+    int ret = dbenv.log_flush(NULL);
+    if (ret != 0)
+        printf("CDBEnv::SyncLog : error %s (%d)\n", DbEnv::strerror(ret), ret);
+}
+
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), fSyncOnClose(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -282,12 +294,12 @@ void CDB::Flush()
     if (activeTxn)
         return;
 
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
-
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100)*1024 : 0, nMinutes, 0);
+    // Writes are synced by the wallet flush thread, all together, instead of
+    // checkpointing on every handle close; checkpoints only happen once
+    // enough log has built up, or a minute has passed
+    if (fSyncOnClose)
+        bitdb.SyncLog();
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, 1, 0);
 }
 
 void CDB::Close()
@@ -304,6 +316,8 @@ void CDB::Close()
     {
         LOCK(bitdb.cs_db);
         --bitdb.mapFileUseCount[strFile];
+        if (!fReadOnly)
+            bitdb.nWriteHandlesClosed++;
     }
 }
 
@@ -489,22 +503,23 @@ void CDBEnv::Flush(bool fShutdown)
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
+    pathLog = GetDataDir() / "peers.log";
 }
 
-bool CAddrDB::Write(const CAddrMan& addr)
+// peers.log is compacted into peers.dat once it is bigger than peers.dat,
+// but not before it reaches this size
+static const uint64 ADDRDB_LOG_MIN_COMPACT_SIZE = 256 * 1024;
+
+bool CAddrDB::Write(CAddrMan& addr)
 {
+    // everything up to now goes into the full dump
+    CAddrManSnapshotPtr pSnap = addr.TakeDumpSnapshot();
+
     // Generate random temporary filename
     unsigned short randv = 0;
     RAND_bytes((unsigned char *)&randv, sizeof(randv));
     std::string tmpfn = strprintf("peers.dat.%04x", randv);
 
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(pchMessageStart);
-    ssPeers << addr;
-    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
-    ssPeers << hash;
-
     // open temp output file, and associate with CAutoFile
     boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
     FILE *file = fopen(pathTmp.string().c_str(), "wb");
@@ -512,9 +527,15 @@ bool CAddrDB::Write(const CAddrMan& addr)
     if (!fileout)
         return error("CAddrman::Write() : open failed");
 
-    // Write and commit header, data
+    // serialize addresses straight to the file, checksum data up to that
+    // point, then append csum
+    uint256 hash;
     try {
-        fileout << ssPeers;
+        CHashingWriter<CAutoFile> hashout(fileout);
+        hashout << FLATDATA(pchMessageStart);
+        hashout << *pSnap;
+        hash = hashout.GetHash();
+        fileout << hash;
     }
     catch (std::exception &e) {
         return error("CAddrman::Write() : I/O error");
@@ -526,59 +547,162 @@ bool CAddrDB::Write(const CAddrMan& addr)
     if (!RenameOver(pathTmp, pathAddr))
         return error("CAddrman::Write() : Rename-into-place failed");
 
+    return StartLog(hash);
+}
+
+bool CAddrDB::StartLog(const uint256& hashBase)
+{
+    boost::filesystem::path pathTmp = GetDataDir() / "peers.log.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CAddrDB::StartLog() : open failed");
+    try {
+        fileout << FLATDATA(pchMessageStart);
+        fileout << hashBase;
+    }
+    catch (std::exception &e) {
+        return error("CAddrDB::StartLog() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, pathLog))
+        return error("CAddrDB::StartLog() : Rename-into-place failed");
     return true;
 }
 
-bool CAddrDB::Read(CAddrMan& addr)
+bool CAddrDB::Append(CAddrMan& addr)
 {
-    // open input file, and associate with CAutoFile
-    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    std::vector<CAddrManLogEntry> vEntries;
+    if (!addr.TakeJournal(vEntries))
+        return false;
+
+    try {
+        if (boost::filesystem::file_size(pathLog) > max(ADDRDB_LOG_MIN_COMPACT_SIZE, (uint64)boost::filesystem::file_size(pathAddr)))
+            return false;
+    } catch (boost::filesystem::filesystem_error &e) {
+        return false; // no log (or peers.dat) yet
+    }
+    if (vEntries.empty())
+        return true;
+
+    // each batch carries its own checksum, so a torn write only loses itself
+    CDataStream ssBatch(SER_DISK, CLIENT_VERSION);
+    ssBatch << vEntries;
+    uint256 hash = Hash(ssBatch.begin(), ssBatch.end());
+    ssBatch << hash;
+
+    FILE *file = fopen(pathLog.string().c_str(), "ab");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CAddrDB::Append() : open failed");
+    try {
+        fileout << ssBatch;
+    }
+    catch (std::exception &e) {
+        return error("CAddrDB::Append() : I/O error");
+    }
+    FileCommit(fileout);
+    return true;
+}
+
+void CAddrDB::ReadLog(CAddrMan& addr, const uint256& hashBase)
+{
+    FILE *file = fopen(pathLog.string().c_str(), "rb");
     CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!filein)
-        return error("CAddrman::Read() : open failed");
-
-    // use file size to size memory buffer
-    int fileSize = GetFilesize(filein);
-    int dataSize = fileSize - sizeof(uint256);
-    //Don't try to resize to a negative number if file is small
-    if ( dataSize < 0 ) dataSize = 0;
-    vector<unsigned char> vchData;
-    vchData.resize(dataSize);
-    uint256 hashIn;
+        return;
 
-    // read data and checksum from file
+    unsigned char pchMsgTmp[4];
+    uint256 hashLogBase;
     try {
-        filein.read((char *)&vchData[0], dataSize);
-        filein >> hashIn;
+        filein >> FLATDATA(pchMsgTmp);
+        filein >> hashLogBase;
     }
     catch (std::exception &e) {
-        return error("CAddrman::Read() 2 : I/O error or stream data corrupted");
+        return;
+    }
+    if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)) || hashLogBase != hashBase)
+    {
+        printf("CAddrDB::ReadLog() : peers.log does not belong to peers.dat, ignoring it\n");
+        return;
+    }
+
+    int nBatches = 0, nEntries = 0;
+    bool fTorn = false;
+    while (true)
+    {
+        std::vector<CAddrManLogEntry> vEntries;
+        uint256 hashBatch;
+        long nBatchPos = ftell(filein);
+        try {
+            CHashVerifier<CAutoFile> verifier(filein);
+            verifier >> vEntries;
+            filein >> hashBatch;
+            if (hashBatch != verifier.GetHash())
+                fTorn = true;
+        }
+        catch (std::exception &e) {
+            // clean end of file, or a batch cut short
+            fseek(filein, 0, SEEK_END);
+            fTorn = (ftell(filein) != nBatchPos);
+        }
+        if (fTorn || vEntries.empty())
+            break;
+        addr.Replay(vEntries);
+        nBatches++;
+        nEntries += vEntries.size();
     }
     filein.fclose();
+    printf("Replayed %d address changes in %d batches from peers.log\n", nEntries, nBatches);
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
+    // Nothing can be appended after a damaged batch, start over
+    if (fTorn)
+    {
+        printf("CAddrDB::ReadLog() : peers.log damaged, compacting\n");
+        Write(addr);
+    }
+}
 
-    // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
-    if (hashIn != hashTmp)
-        return error("CAddrman::Read() : checksum mismatch; data corrupted");
+bool CAddrDB::Read(CAddrMan& addr)
+{
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CAddrman::Read() : open failed");
 
-    unsigned char pchMsgTmp[4];
+    // de-serialize straight from the file, hashing as we go
+    uint256 hashIn;
+    CHashVerifier<CAutoFile> verifier(filein);
     try {
         // de-serialize file header (pchMessageStart magic number) and
-        ssPeers >> FLATDATA(pchMsgTmp);
+        unsigned char pchMsgTmp[4];
+        verifier >> FLATDATA(pchMsgTmp);
 
         // verify the network matches ours
         if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
             return error("CAddrman::Read() : invalid network magic number");
 
         // de-serialize address data into one CAddrMan object
-        ssPeers >> addr;
+        verifier >> addr;
+        filein >> hashIn;
     }
     catch (std::exception &e) {
+        addr.Clear();
         return error("CAddrman::Read() : I/O error or stream data corrupted");
     }
+    filein.fclose();
+
+    // verify stored checksum matches input data
+    if (hashIn != verifier.GetHash())
+    {
+        addr.Clear();
+        return error("CAddrman::Read() : checksum mismatch; data corrupted");
+    }
 
+    ReadLog(addr, hashIn);
     return true;
 }
 
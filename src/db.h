@@ -24,6 +24,9 @@ class CWalletTx;
 
 extern unsigned int nWalletDBUpdated;
 
+/** Default for -walletsyncms, how often the wallet flush thread syncs the database log */
+static const int DEFAULT_WALLET_SYNC_MS = 100;
+
 void ThreadFlushWalletDB(const std::string& strWalletFile);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
@@ -42,6 +45,9 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    // Count of writable handles closed, so the wallet flush thread knows
+    // when there are writes for it to sync; requires cs_db
+    unsigned int nWriteHandlesClosed;
 
     CDBEnv();
     ~CDBEnv();
@@ -70,6 +76,7 @@ public:
     void Close();
     void Flush(bool fShutdown);
     void CheckpointLSN(std::string strFile);
+    void SyncLog();
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
@@ -95,12 +102,16 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    bool fSyncOnClose;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
 public:
     void Flush();
     void Close();
+    // Make this handle's writes durable as soon as it is closed, rather than
+    // leaving them to the wallet flush thread's next log sync
+    void SyncOnClose() { fSyncOnClose = true; }
 private:
     CDB(const CDB&);
     void operator=(const CDB&);
@@ -280,7 +291,10 @@ public:
             return false;
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
-        return (ret == 0);
+        if (ret != 0)
+            return false;
+        bitdb.SyncLog();
+        return true;
     }
 
     bool TxnAbort()
@@ -313,14 +327,30 @@ public:
 
 
 
-/** Access to the (IP) address database (peers.dat) */
+/** Access to the address database (peers.dat + peers.log)
+ *
+ * peers.dat holds a full copy of the tables. Changes made since it was
+ * written are appended to peers.log in checksummed batches; the log names
+ * the peers.dat it extends, so a stale log is never replayed on a newer
+ * dump. Once the log outgrows peers.dat the two are compacted into a new
+ * peers.dat.
+ */
 class CAddrDB
 {
 private:
     boost::filesystem::path pathAddr;
+    boost::filesystem::path pathLog;
+
+    bool StartLog(const uint256& hashBase);
+    void ReadLog(CAddrMan& addr, const uint256& hashBase);
+
 public:
     CAddrDB();
-    bool Write(const CAddrMan& addr);
+    // Write all addresses to a new peers.dat and start an empty peers.log.
+    bool Write(CAddrMan& addr);
+    // Append the changes since the last Write or Append to peers.log. Returns
+    // false if a Write is needed instead.
+    bool Append(CAddrMan& addr);
     bool Read(CAddrMan& addr);
 };
 
@@ -62,6 +62,54 @@ public:
     }
 };
 
+/** Writes to another stream while hashing everything written, so data can
+ *  be checksummed on its way to disk without being buffered first. */
+template<typename Sink>
+class CHashingWriter : public CHashWriter
+{
+private:
+    Sink& sink;
+
+public:
+    CHashingWriter(Sink& sinkIn) : CHashWriter(sinkIn.nType, sinkIn.nVersion), sink(sinkIn) {}
+
+    CHashingWriter<Sink>& write(const char *pch, size_t size) {
+        sink.write(pch, size);
+        CHashWriter::write(pch, size);
+        return (*this);
+    }
+
+    template<typename T>
+    CHashingWriter<Sink>& operator<<(const T& obj) {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** Reads from another stream while hashing everything read, so a checksum
+ *  can be verified while deserializing straight from a file. */
+template<typename Source>
+class CHashVerifier : public CHashWriter
+{
+private:
+    Source& source;
+
+public:
+    CHashVerifier(Source& sourceIn) : CHashWriter(sourceIn.nType, sourceIn.nVersion), source(sourceIn) {}
+
+    CHashVerifier<Source>& read(char *pch, size_t size) {
+        source.read(pch, size);
+        CHashWriter::write(pch, size);
+        return (*this);
+    }
+
+    template<typename T>
+    CHashVerifier<Source>& operator>>(T& obj) {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 
 template<typename T1, typename T2>
 inline uint256 Hash(const T1 p1begin, const T1 p1end,
@@ -121,6 +169,16 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
+template<unsigned int N>
+inline uint160 Hash160(const prevector<N, unsigned char>& vch)
+{
+    return Hash160(vch.begin(), vch.end());
+}
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a uint256, keyed with (k0, k1). Much cheaper than SHA256 for
+ *  short identifiers that only need to resist precomputation. */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
@@ -320,6 +320,11 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadrate=<n>     " + _("Limit total upload rate to <n>*1000 bytes per second (default: 0 = unlimited)") + "\n" +
+        "  -maxdownloadrate=<n>   " + _("Limit total download rate to <n>*1000 bytes per second (default: 0 = unlimited)") + "\n" +
+        "  -maxinbounduploadrate=<n>   " + _("Limit upload rate to inbound peers to <n>*1000 bytes per second (default: 0 = unlimited)") + "\n" +
+        "  -maxinbounddownloadrate=<n> " + _("Limit download rate from inbound peers to <n>*1000 bytes per second (default: 0 = unlimited)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Try to keep upload under <n> MiB per 24h; once close, stop serving historical blocks (default: 0 = no limit)") + "\n" +
         "  -bloomfilters          " + _("Allow peers to set bloom filters (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
@@ -366,6 +371,7 @@ std::string HelpMessage()
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
         "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -msgthreads=<n>        " + _("Set the number of peer message processing threads (up to 16, 0 = auto, default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -539,9 +545,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef USE_EPOLL
+    // epoll has no FD_SETSIZE limit; only the process file descriptor limit applies
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -562,6 +573,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -msgthreads=0 means one per core; most messages still serialize on cs_main
+    nMessageHandlerThreads = GetArg("-msgthreads", 0);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = boost::thread::hardware_concurrency();
+    nMessageHandlerThreads = std::max(std::min(nMessageHandlerThreads, MAX_MESSAGE_HANDLER_THREADS), 1);
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -1116,7 +1133,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("mapWallet.size() = %"PRIszu"\n",       pwalletMain ? pwalletMain->mapWallet.size() : 0);
     printf("mapAddressBook.size() = %"PRIszu"\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 
-    StartNode(threadGroup);
+    if (!StartNode(threadGroup))
+        return InitError(_("Unable to start the network socket handler."));
 
     if (fServer)
         StartRPCThreads();
@@ -1131,6 +1149,9 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // and one to keep the key pool filled
+        threadGroup.create_thread(boost::bind(&ThreadKeyPoolWorker, pwalletMain));
     }
 
     return !fRequestShutdown;
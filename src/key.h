@@ -198,6 +198,14 @@ public:
         memcpy(vch, secret.vch, sizeof(vch));
     }
 
+    // Assignment keeps our own (already locked) buffer.
+    CKey& operator=(const CKey &secret) {
+        fValid = secret.fValid;
+        fCompressed = secret.fCompressed;
+        memcpy(vch, secret.vch, sizeof(vch));
+        return *this;
+    }
+
     // Destructor (again necessary because of memlocking).
     ~CKey() {
         UnlockObject(vch);
@@ -61,6 +61,21 @@ multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// Announced blocks we still have to download (requires cs_main). Blocks wait
+// in lBlockDownloadQueue, roughly in height order, until SendMessages hands
+// them to a peer; entries already in flight or received are dropped lazily.
+struct CBlockDownload
+{
+    int nHeight;            // estimated from where it was announced
+    CNode* pnodeSource;     // peer that announced it
+    CNode* pnodeInFlight;   // peer it is requested from, if any
+    int64 nTimeRequested;
+    int nAttempts;
+    bool fLastInBatch;      // last block of a getblocks reply
+};
+static map<uint256, CBlockDownload> mapBlockDownloads;
+static list<uint256> lBlockDownloadQueue;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -1226,11 +1241,11 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
 {
     // mark inputs spent
     if (!IsCoinBase()) {
+        txundo.vprevout.reserve(txundo.vprevout.size() + vin.size());
         BOOST_FOREACH(const CTxIn &txin, vin) {
             CCoins &coins = inputs.GetCoins(txin.prevout.hash);
-            CTxInUndo undo;
-            assert(coins.Spend(txin.prevout, undo));
-            txundo.vprevout.push_back(undo);
+            txundo.vprevout.push_back(CTxInUndo());
+            assert(coins.Spend(txin.prevout, txundo.vprevout.back()));
         }
     }
 
@@ -1517,7 +1532,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
     unsigned int flags = SCRIPT_VERIFY_NOCACHE | SCRIPT_VERIFY_P2SH ;
 
-    CBlockUndo blockundo;
+    // Undo data and tx index entries for this block are built in a single
+    // arena and released in one go
+    CArena arena;
+    CBlockUndo blockundo(&arena);
+    blockundo.vtxundo.reserve(vtx.size() - 1);
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
@@ -1526,8 +1545,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     int nInputs = 0;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    CTxIndexList vPos((arena_allocator<std::pair<uint256, CDiskTxPos> >(&arena)));
     vPos.reserve(vtx.size());
+    std::vector<CScriptCheck> vChecks;
+    unsigned int nChecks = 0, nScriptHeapCopies = 0;
+    size_t nScriptHeapBytes = 0;
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
@@ -1552,16 +1574,27 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
 
             nFees += tx.GetValueIn(view)-tx.GetValueOut();
 
-            std::vector<CScriptCheck> vChecks;
             if (!tx.CheckInputs(state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;   
+            nChecks += vChecks.size();
+            BOOST_FOREACH(const CScriptCheck &check, vChecks) {
+                size_t nHeap = check.GetScriptHeapBytes();
+                if (nHeap) {
+                    nScriptHeapCopies++;
+                    nScriptHeapBytes += nHeap;
+                }
+            }
             control.Add(vChecks);
+            vChecks.clear();
         }
 
-        CTxUndo txundo;
-        tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
-        if (!tx.IsCoinBase())
-            blockundo.vtxundo.push_back(txundo);
+        if (tx.IsCoinBase()) {
+            CTxUndo txundo;
+            tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        } else {
+            blockundo.vtxundo.push_back(CTxUndo(&arena));
+            tx.UpdateCoins(state, view, blockundo.vtxundo.back(), pindex->nHeight, GetTxHash(i));
+        }
 
         vPos.push_back(std::make_pair(GetTxHash(i), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
@@ -1569,6 +1602,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
         printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+    if (fBenchmark || fDebug)
+    {
+        printf("ConnectBlock() : block arena %"PRIszu" allocations, %"PRIszu" bytes in %"PRIszu" chunks\n", arena.GetAllocations(), arena.GetBytes(), arena.GetChunks());
+        printf("ConnectBlock() : %u script checks, %u scriptPubKey copies on the heap (%"PRIszu" bytes)\n", nChecks, nScriptHeapCopies, nScriptHeapBytes);
+    }
 
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%"PRI64d" vs limit=%"PRI64d")", vtx[0].GetValueOut(), GetBlockValue(pindex->nHeight, nFees)));
@@ -2142,8 +2180,11 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless the
+            // missing parent is already on its way from some peer
+            uint256 hashRoot = GetOrphanRoot(pblock2);
+            if (!mapBlockDownloads.count(mapOrphanBlocks[hashRoot]->hashPrevBlock))
+                pfrom->PushGetBlocks(pindexBest, hashRoot);
         }
         return true;
     }
@@ -2213,6 +2254,41 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header = block.GetBlockHeader();
+    BlockSignature = block.BlockSignature;
+    nNonce = GetRand(std::numeric_limits<uint64>::max());
+    FillShortIDKeys();
+
+    // The coinbase can't be in anyone's memory pool, send it along
+    if (!block.vtx.empty())
+    {
+        vPrefilledTxn.resize(1);
+        vPrefilledTxn[0].nIndex = 0;
+        vPrefilledTxn[0].tx = block.vtx[0];
+    }
+    vShortTxIDs.reserve(block.vtx.size());
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKeys()
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hash = ss.GetHash();
+    nShortIDKey0 = hash.Get64(0);
+    nShortIDKey1 = hash.Get64(1);
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& hash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, hash) & 0xffffffffffffULL;
+}
+
+
+
 
 
 
@@ -2897,6 +2973,45 @@ bool static AlreadyHave(const CInv& inv)
 unsigned char pchMessageStart[4] = { 0x46, 0x55, 0x45, 0x4c }; 
 
 
+// Recently served blocks, framed as "block" or "cmpctblock" messages, so a
+// block fetched by many peers is read, serialized and checksummed once
+static CCriticalSection cs_mapBlockMessages;
+static map<CInv, CSharedNetMessage> mapBlockMessages;
+static deque<CInv> vBlockMessagesOrder;
+static const unsigned int MAX_BLOCK_MESSAGES = 16;
+
+// nType is MSG_BLOCK or MSG_CMPCT_BLOCK
+static CSharedNetMessage GetBlockMessage(CBlockIndex* pindex, int nType)
+{
+    CInv inv(nType, pindex->GetBlockHash());
+    {
+        LOCK(cs_mapBlockMessages);
+        map<CInv, CSharedNetMessage>::iterator mi = mapBlockMessages.find(inv);
+        if (mi != mapBlockMessages.end())
+            return (*mi).second;
+    }
+
+    CBlock block;
+    block.ReadFromDisk(pindex);
+    CSharedNetMessage msg;
+    if (nType == MSG_CMPCT_BLOCK)
+        msg = MakeNetMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    else
+        msg = MakeNetMessage("block", block);
+
+    LOCK(cs_mapBlockMessages);
+    if (mapBlockMessages.insert(make_pair(inv, msg)).second)
+    {
+        vBlockMessagesOrder.push_back(inv);
+        if (vBlockMessagesOrder.size() > MAX_BLOCK_MESSAGES)
+        {
+            mapBlockMessages.erase(vBlockMessagesOrder.front());
+            vBlockMessagesOrder.pop_front();
+        }
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -2919,19 +3034,42 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                // Send block from disk; only the index lookup needs cs_main
+                CBlockIndex* pindex = NULL;
+                {
+                    LOCK(cs_main);
+                    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                }
+
+                // Past the -maxuploadtarget reserve only recent blocks are
+                // served; a peer still syncing history has to go elsewhere
+                if (pindex && pindex->GetBlockTime() < GetAdjustedTime() - 7 * 24 * 60 * 60 && OutboundTargetReached(true))
+                {
+                    printf("historical block serving limit reached, disconnecting %s\n", pfrom->addr.ToString().c_str());
+                    pfrom->fDisconnect = true;
+                    break;
+                }
+
                 pfrom->nBlocksRequested++;
-                if (mi != mapBlockIndex.end())
+                if (pindex)
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                        pfrom->PushMessage(GetBlockMessage(pindex, MSG_BLOCK));
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+                            pfrom->PushMessage(GetBlockMessage(pindex, MSG_CMPCT_BLOCK));
+                        else
+                            pfrom->PushMessage(GetBlockMessage(pindex, MSG_BLOCK));
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        block.ReadFromDisk(pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -2945,8 +3083,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -2959,7 +3104,10 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        {
+                            LOCK(cs_main);
+                            vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        }
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -2971,9 +3119,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedNetMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3015,6 +3163,296 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Credit pnode (or nobody) with announcing a queued block. Requires cs_main.
+void static SetBlockDownloadSource(CBlockDownload& download, CNode* pnode)
+{
+    if (download.pnodeSource)
+        download.pnodeSource->nBlocksQueued--;
+    download.pnodeSource = pnode;
+    if (pnode)
+        pnode->nBlocksQueued++;
+}
+
+// Forget a block download. Requires cs_main.
+void static EraseBlockDownload(map<uint256, CBlockDownload>::iterator mi)
+{
+    SetBlockDownloadSource((*mi).second, NULL);
+    mapBlockDownloads.erase(mi);
+}
+
+// Remember a block pfrom announced at (about) height nHeight, to be
+// fetched by the download scheduler. A peer can only have
+// MAX_BLOCKS_QUEUED_PER_PEER blocks queued on its word. Requires cs_main.
+void static QueueBlockDownload(CNode* pfrom, const uint256& hash, int nHeight, bool fLastInBatch)
+{
+    pfrom->nAnnouncedHeight = max(pfrom->nAnnouncedHeight, nHeight);
+    bool fFull = (pfrom->nBlocksQueued >= MAX_BLOCKS_QUEUED_PER_PEER);
+
+    map<uint256, CBlockDownload>::iterator mi = mapBlockDownloads.find(hash);
+    if (mi != mapBlockDownloads.end())
+    {
+        if ((*mi).second.pnodeSource == NULL && !fFull)
+            SetBlockDownloadSource((*mi).second, pfrom);
+        return;
+    }
+    if (fFull)
+        return;
+
+    CBlockDownload download;
+    download.nHeight = nHeight;
+    download.pnodeSource = NULL;
+    download.pnodeInFlight = NULL;
+    download.nTimeRequested = 0;
+    download.nAttempts = 0;
+    download.fLastInBatch = fLastInBatch;
+    SetBlockDownloadSource(mapBlockDownloads.insert(make_pair(hash, download)).first->second, pfrom);
+    lBlockDownloadQueue.push_back(hash);
+}
+
+// A block arrived from pfrom: retire its request and update the throughput
+// estimate of the peer it was requested from. Requires cs_main.
+void static MarkBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    map<uint256, CBlockDownload>::iterator mi = mapBlockDownloads.find(hash);
+    if (mi == mapBlockDownloads.end())
+        return;
+
+    CBlockDownload& download = (*mi).second;
+    CNode* pnode = download.pnodeInFlight;
+    if (pnode)
+    {
+        pnode->setBlocksInFlight.erase(hash);
+        if (pnode == pfrom)
+        {
+            // With several blocks in flight the time between arrivals is what
+            // measures the peer, not the time since each request
+            int64 nNow = GetTimeMicros();
+            int64 nStart = max(download.nTimeRequested, pnode->nLastBlockTime);
+            double dSample = 1000000.0 / max(nNow - nStart, (int64)1000);
+            if (pnode->nBlocksDownloaded == 0)
+                pnode->dBlockRate = dSample;
+            else
+                pnode->dBlockRate = 0.8 * pnode->dBlockRate + 0.2 * dSample;
+            pnode->nBlocksDownloaded++;
+            pnode->nLastBlockTime = nNow;
+        }
+    }
+    EraseBlockDownload(mi);
+}
+
+// Number of blocks to keep requested from pnode: enough to cover
+// BLOCK_DOWNLOAD_WINDOW_SECONDS at its measured rate, so faster peers end
+// up serving more of the chain
+unsigned int static BlockDownloadWindow(const CNode* pnode)
+{
+    if (pnode->nBlocksDownloaded == 0)
+        return pnode->nBlockStalls ? 1 : BLOCK_DOWNLOAD_WINDOW_DEFAULT;
+    unsigned int nWindow = (unsigned int)(pnode->dBlockRate * BLOCK_DOWNLOAD_WINDOW_SECONDS);
+    return max(1u, min(nWindow, MAX_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
+// Reassign requests pto has sat on for too long, then top up its window
+// from the download queue. Requires cs_main.
+void static ScheduleBlockDownloads(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTimeMicros();
+
+    vector<uint256> vStalled;
+    BOOST_FOREACH(const uint256& hash, pto->setBlocksInFlight)
+        if (mapBlockDownloads[hash].nTimeRequested < nNow - BLOCK_DOWNLOAD_TIMEOUT * 1000000LL)
+            vStalled.push_back(hash);
+    BOOST_FOREACH(const uint256& hash, vStalled)
+    {
+        pto->setBlocksInFlight.erase(hash);
+        CBlockDownload& download = mapBlockDownloads[hash];
+        // Nobody seems to have it; if it is real it will be announced again
+        if (download.nAttempts >= 4)
+        {
+            EraseBlockDownload(mapBlockDownloads.find(hash));
+            continue;
+        }
+        download.pnodeInFlight = NULL;
+        if (download.pnodeSource == pto)
+            SetBlockDownloadSource(download, NULL);
+        lBlockDownloadQueue.push_front(hash);
+    }
+    if (!vStalled.empty())
+    {
+        pto->nBlockStalls++;
+        pto->dBlockRate /= 2;
+        printf("block download from %s stalled, reassigning %"PRIszu" blocks\n", pto->addr.ToString().c_str(), vStalled.size());
+    }
+
+    if (pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+
+    unsigned int nWindow = BlockDownloadWindow(pto);
+    if (pto->setBlocksInFlight.size() >= nWindow)
+        return;
+
+    // Blocks above what pto claims to have are passed over. Every block not
+    // passed over is requested, so the window bounds those, and the queue
+    // itself is bounded by MAX_BLOCKS_QUEUED_PER_PEER per announcing peer.
+    int nMaxHeight = max(pto->nStartingHeight, pto->nAnnouncedHeight);
+    // Once caught up, peers that support it send new blocks compactly
+    bool fCompact = pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload();
+    list<uint256>::iterator it = lBlockDownloadQueue.begin();
+    while (it != lBlockDownloadQueue.end() && pto->setBlocksInFlight.size() < nWindow)
+    {
+        map<uint256, CBlockDownload>::iterator mi = mapBlockDownloads.find(*it);
+        if (mi == mapBlockDownloads.end() || (*mi).second.pnodeInFlight)
+        {
+            it = lBlockDownloadQueue.erase(it);
+            continue;
+        }
+        if (AlreadyHave(CInv(MSG_BLOCK, *it)))
+        {
+            EraseBlockDownload(mi);
+            it = lBlockDownloadQueue.erase(it);
+            continue;
+        }
+
+        CBlockDownload& download = (*mi).second;
+        bool fSource = (download.pnodeSource == pto);
+        // The last block of a getblocks reply goes to the peer that sent it,
+        // which then announces its tip so the sync can continue
+        if (!fSource && (download.nHeight > nMaxHeight || (download.fLastInBatch && download.pnodeSource)))
+        {
+            it++;
+            continue;
+        }
+
+        download.pnodeInFlight = pto;
+        download.nTimeRequested = nNow;
+        download.nAttempts++;
+        if (pto->setBlocksInFlight.empty())
+            pto->nLastBlockTime = nNow;
+        pto->setBlocksInFlight.insert(*it);
+        if (fDebugNet)
+            printf("sending getdata: block %s to %s\n", (*it).ToString().c_str(), pto->addr.ToString().c_str());
+        vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, *it));
+        it = lBlockDownloadQueue.erase(it);
+    }
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    BOOST_FOREACH(const uint256& hash, pnode->setBlocksInFlight)
+    {
+        mapBlockDownloads[hash].pnodeInFlight = NULL;
+        lBlockDownloadQueue.push_front(hash);
+    }
+    pnode->setBlocksInFlight.clear();
+
+    // Drop what we only queued on pnode's word; blocks in flight from others stay
+    for (map<uint256, CBlockDownload>::iterator mi = mapBlockDownloads.begin(); mi != mapBlockDownloads.end(); )
+    {
+        if ((*mi).second.pnodeSource != pnode)
+            mi++;
+        else if ((*mi).second.pnodeInFlight == NULL)
+            EraseBlockDownload(mi++);
+        else
+            SetBlockDownloadSource((*mi++).second, NULL);
+    }
+}
+
+// Hand a block from pfrom, received in full or rebuilt from a compact block,
+// to ProcessBlock. Requires cs_main.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    MarkBlockReceived(pfrom, inv.hash);
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
+// Compact blocks waiting for a "blocktxn" answer, by block hash (requires cs_main)
+struct CPartialBlock
+{
+    CBlock block;
+    std::vector<unsigned int> vMissing;
+    int64 nTime;
+    CService addrFrom; // only the peer we asked may answer
+};
+
+// "getblocktxn" is only served for blocks this close to the tip
+static const int MAX_BLOCKTXN_DEPTH = 10;
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+// Lay out the transactions of a compact block, taking what we can from the
+// memory pool. vMissing gets the positions that still have to come from the
+// peer. Returns false if the compact block is malformed. Only takes mempool.cs.
+bool static InitPartialBlock(const CBlockHeaderAndShortTxIDs& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    unsigned int nTxCount = cmpctblock.BlockTxCount();
+    if (cmpctblock.vPrefilledTxn.empty() || nTxCount > MAX_BLOCK_SIZE / 60)
+        return false;
+
+    block = CBlock(cmpctblock.header);
+    block.BlockSignature = cmpctblock.BlockSignature;
+    block.vtx.resize(nTxCount);
+
+    vector<bool> vPrefilled(nTxCount, false);
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTxCount || vPrefilled[prefilled.nIndex])
+            return false;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vPrefilled[prefilled.nIndex] = true;
+    }
+
+    // Short ids fill the remaining positions in order
+    map<uint64, unsigned int> mapShortIDs;
+    unsigned int nPos = 0;
+    BOOST_FOREACH(uint64 nShortID, cmpctblock.vShortTxIDs)
+    {
+        while (vPrefilled[nPos])
+            nPos++;
+        if (!mapShortIDs.insert(make_pair(nShortID, nPos)).second)
+            return false; // two transactions of the block share a short id
+        nPos++;
+    }
+
+    // Positions matched by more than one pool transaction are fetched too
+    vector<int> vMatches(nTxCount, 0);
+    {
+        LOCK(mempool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        {
+            map<uint64, unsigned int>::const_iterator it = mapShortIDs.find(cmpctblock.GetShortID((*mi).first));
+            if (it == mapShortIDs.end())
+                continue;
+            if (vMatches[(*it).second]++ == 0)
+                block.vtx[(*it).second] = (*mi).second;
+        }
+    }
+
+    vMissing.clear();
+    for (unsigned int i = 0; i < nTxCount; i++)
+        if (!vPrefilled[i] && vMatches[i] != 1)
+            vMissing.push_back(i);
+    return true;
+}
+
+// Process a rebuilt compact block, falling back to fetching it in full when
+// a short id matched the wrong transaction. Requires cs_main.
+void static FinishPartialBlock(CNode* pfrom, CBlock& block)
+{
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s failed to rebuild, requesting full block\n", block.GetHash().ToString().c_str());
+        vector<CInv> vGetData(1, CInv(MSG_BLOCK, block.GetHash()));
+        pfrom->PushMessage("getdata", vGetData);
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3032,6 +3470,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     if (strCommand == "version")
     {
+        LOCK(cs_main);
+
         // Each connection can only send one version message
         if (pfrom->nVersion != 0)
         {
@@ -3218,6 +3658,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return error("message inv size() = %"PRIszu"", vInv.size());
         }
 
+        LOCK(cs_main);
+
         // find last block in inv vector
         unsigned int nLastBlock = (unsigned int)(-1);
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
@@ -3226,6 +3668,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 break;
             }
         }
+        int nBlockInv = 0;
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3237,9 +3680,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK)
+                nBlockInv++;
+
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
-                    pfrom->AskFor(inv);
+                {
+                    // Blocks in an inv are consecutive, starting about where we are
+                    if (inv.type == MSG_BLOCK)
+                        QueueBlockDownload(pfrom, inv.hash, nBestHeight + nBlockInv, nInv == nLastBlock && nBlockInv > 1);
+                    else
+                        pfrom->AskFor(inv);
+                }
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
@@ -3284,6 +3736,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        LOCK(cs_main);
+
         // Find the last block the caller has in the main chain
         CBlockIndex* pindex = locator.GetBlockIndex();
 
@@ -3318,6 +3772,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        LOCK(cs_main);
+
         CBlockIndex* pindex = NULL;
         if (locator.IsNull())
         {
@@ -3353,15 +3809,37 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
-        CDataStream vMsg(vRecv);
         CTransaction tx;
-        vRecv >> tx;
+        CSpanStream(vRecv) >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Drop duplicates and context-free failures before queueing for cs_main
+        bool fExists;
+        {
+            LOCK(mempool.cs);
+            fExists = mempool.exists(inv.hash);
+        }
+        if (fExists)
+        {
+            LOCK(cs_main);
+            mapAlreadyAskedFor.erase(inv);
+            return true;
+        }
         bool fMissingInputs = false;
         CValidationState state;
+        if (!tx.CheckTransaction(state))
+        {
+            printf("%s from %s %s was not accepted into the memory pool\n", inv.hash.ToString().c_str(),
+                pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str());
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                pfrom->Misbehaving(nDoS);
+            return true;
+        }
+
+        LOCK(cs_main);
         if (tx.AcceptToMemoryPool(state, true, true, &fMissingInputs))
         {
             RelayTransaction(tx, inv.hash);
@@ -3433,7 +3911,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
-        vRecv >> block;
+        CSpanStream ssBlock(vRecv);
+        ssBlock >> block;
+
+        // Parsed in place; if the payload is exactly the block, hand the
+        // buffer over so AcceptBlock can write it out without re-encoding
+        if (ssBlock.empty())
+            vRecv.GetAndClear(block.vchSerialized);
 
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
@@ -3441,19 +3925,147 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        LOCK(cs_main);
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hash);
+        pfrom->AddInventoryKnown(inv);
+
+        printf("received compact block %s (%u txs, %"PRIszu" prefilled)\n", hash.ToString().c_str(),
+               cmpctblock.BlockTxCount(), cmpctblock.vPrefilledTxn.size());
+
+        // Rebuilding a compact block takes a pass over the memory pool, so
+        // only do it for ones we asked this peer for and aren't already
+        // rebuilding, and without holding cs_main
+        {
+            LOCK(cs_main);
+            if (AlreadyHave(inv) || !pfrom->setBlocksInFlight.count(hash) || mapPartialBlocks.count(hash))
+                return true;
+        }
+
+        CBlock block;
+        vector<unsigned int> vMissing;
+        if (!InitPartialBlock(cmpctblock, block, vMissing))
+        {
+            pfrom->Misbehaving(100);
+            return error("message cmpctblock malformed");
+        }
+
+        LOCK(cs_main);
+        if (AlreadyHave(inv))
+            return true;
+
+        if (vMissing.empty())
+        {
+            FinishPartialBlock(pfrom, block);
+            return true;
+        }
+
+        // Forget requests that were never answered
+        int64 nNow = GetTime();
+        for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); )
+        {
+            if ((*mi).second.nTime < nNow - 60)
+                mapPartialBlocks.erase(mi++);
+            else
+                mi++;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        req.vIndexes = vMissing;
+        CPartialBlock& partial = mapPartialBlocks[hash];
+        partial.block = block;
+        partial.vMissing.swap(vMissing);
+        partial.nTime = nNow;
+        partial.addrFrom = pfrom->addr;
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        CBlockIndex* pindex = NULL;
+        {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain() &&
+                (*mi).second->nHeight > pindexBest->nHeight - MAX_BLOCKTXN_DEPTH)
+                pindex = (*mi).second;
+        }
+        if (!pindex)
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("getblocktxn : unable to read block %s", req.blockhash.ToString().c_str());
+
+        // Indexes must be strictly increasing, so the answer is never larger than the block
+        if (req.vIndexes.size() > block.vtx.size())
+        {
+            pfrom->Misbehaving(100);
+            return error("message getblocktxn asks for %"PRIszu" transactions of %"PRIszu"", req.vIndexes.size(), block.vtx.size());
+        }
+        for (unsigned int i = 0; i < req.vIndexes.size(); i++)
+        {
+            if (req.vIndexes[i] >= block.vtx.size() || (i > 0 && req.vIndexes[i] <= req.vIndexes[i - 1]))
+            {
+                pfrom->Misbehaving(100);
+                return error("message getblocktxn index %u out of range or out of order", req.vIndexes[i]);
+            }
+        }
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+            resp.vtx.push_back(block.vtx[nIndex]);
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.blockhash);
+        if (mi == mapPartialBlocks.end() || (*mi).second.addrFrom != pfrom->addr)
+            return true;
+        CPartialBlock partial;
+        std::swap(partial, (*mi).second);
+        mapPartialBlocks.erase(mi);
+
+        if (resp.vtx.size() != partial.vMissing.size())
+        {
+            pfrom->Misbehaving(10);
+            return error("message blocktxn has %"PRIszu" transactions, expected %"PRIszu"", resp.vtx.size(), partial.vMissing.size());
+        }
+        for (unsigned int i = 0; i < partial.vMissing.size(); i++)
+            partial.block.vtx[partial.vMissing[i]] = resp.vtx[i];
+
+        FinishPartialBlock(pfrom, partial.block);
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrKnown);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3503,6 +4115,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CAlert alert;
         vRecv >> alert;
 
+        LOCK(cs_main);
+
         uint256 alertHash = alert.GetHash();
         if (pfrom->setKnown.count(alertHash) == 0)
         {
@@ -3664,26 +4278,22 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, already computed by the socket thread as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (!msg.checksumValid())
         {
             printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+               strCommand.c_str(), nMessageSize, msg.nDataChecksum, hdr.nChecksum);
             continue;
         }
 
         // Process message
         bool fRet = false;
+        int64 nStart = GetTimeMicros();
         try
         {
-            {
-                LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv);
-            }
+            fRet = ProcessMessage(pfrom, strCommand, vRecv);
+            RecordMessageProcessed(pfrom, strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nStart);
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -3765,7 +4375,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_addrKnown);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -3785,80 +4398,68 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_addrKnown);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
         }
 
 
         //
         // Message: inventory
         //
+        // Block invs go out right away. Transaction invs are held back and
+        // flushed in batches at Poisson distributed times, independently per
+        // peer, which hides where a transaction came from as the old single
+        // trickle node did but without funnelling everything through one peer.
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            int64 nNow = GetTimeMicros();
+            bool fSendTxInv = false;
+            if (pto->nNextInvSend < nNow)
+            {
+                fSendTxInv = true;
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+            }
+
+            vector<CInv> vInvWait;
+            unsigned int nTxInv = 0;
+            vInv.reserve(min(pto->vInventoryToSend.size(), (size_t)MAX_INV_SZ));
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (inv.type == MSG_TX)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
+                    if (!fSendTxInv || nTxInv >= INVENTORY_BROADCAST_MAX)
                     {
                         vInvWait.push_back(inv);
                         continue;
                     }
+                    nTxInv++;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= MAX_INV_SZ)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -3868,6 +4469,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (!fImporting && !fReindex)
+            ScheduleBlockDownloads(pto, vGetData);
+
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
@@ -4246,7 +4850,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
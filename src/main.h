@@ -40,6 +40,16 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of blocks requested from a single peer at once */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** The maximum number of announced blocks waiting to be downloaded on a single peer's word */
+static const int MAX_BLOCKS_QUEUED_PER_PEER = 1024;
+/** Number of blocks requested from a peer before its throughput is known */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW_DEFAULT = 4;
+/** Seconds worth of a peer's measured block throughput kept requested from it */
+static const int BLOCK_DOWNLOAD_WINDOW_SECONDS = 10;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int BLOCK_DOWNLOAD_TIMEOUT = 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -160,6 +170,8 @@ CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Give back the block requests of a peer that is being deleted (requires cs_main) */
+void FinalizeNode(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Generate a new block, without valid signature */
@@ -252,6 +264,9 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/** Tx index entries for one block; built in the block's validation arena */
+typedef std::vector<std::pair<uint256, CDiskTxPos>, arena_allocator<std::pair<uint256, CDiskTxPos> > > CTxIndexList;
+
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -759,7 +774,10 @@ class CTxUndo
 {
 public:
     // undo information for all txins
-    std::vector<CTxInUndo> vprevout;
+    std::vector<CTxInUndo, arena_allocator<CTxInUndo> > vprevout;
+
+    CTxUndo() {}
+    explicit CTxUndo(CArena* parena) : vprevout(arena_allocator<CTxInUndo>(parena)) {}
 
     IMPLEMENT_SERIALIZE(
         READWRITE(vprevout);
@@ -770,7 +788,11 @@ public:
 class CBlockUndo
 {
 public:
-    std::vector<CTxUndo> vtxundo; // for all but the coinbase
+    std::vector<CTxUndo, arena_allocator<CTxUndo> > vtxundo; // for all but the coinbase
+
+    CBlockUndo() {}
+    // undo data built in an arena must not outlive it
+    explicit CBlockUndo(CArena* parena) : vtxundo(arena_allocator<CTxUndo>(parena)) {}
 
     IMPLEMENT_SERIALIZE(
         READWRITE(vtxundo);
@@ -1052,8 +1074,12 @@ public:
             return false;
         if (vout[out.n].IsNull())
             return false;
-        undo = CTxInUndo(vout[out.n]);
-        vout[out.n].SetNull();
+        // move the spent output into the undo record instead of copying its script
+        CTxOut &txout = vout[out.n];
+        undo = CTxInUndo();
+        undo.txout.nValue = txout.nValue;
+        undo.txout.scriptPubKey.swap(txout.scriptPubKey);
+        txout.SetNull();
         Cleanup();
         if (vout.size() == 0) {
             undo.nHeight = nHeight;
@@ -1104,6 +1130,9 @@ public:
 
     bool operator()() const;
 
+    // heap bytes held by the scriptPubKey copy (zero when it fits inline)
+    size_t GetScriptHeapBytes() const { return scriptPubKey.allocated_memory(); }
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
@@ -1333,6 +1362,7 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    CSerializeData vchSerialized; // bytes as received from the network, if any
 
     CBlock()
     {
@@ -1345,6 +1375,22 @@ public:
         *((CBlockHeader*)this) = header;
     }
 
+    // Copies (orphans, partial blocks) leave vchSerialized behind: it would
+    // double their memory, and a copy may be changed afterwards
+    CBlock(const CBlock &block) : CBlockHeader(block), vtx(block.vtx), BlockSignature(block.BlockSignature), vMerkleTree(block.vMerkleTree)
+    {
+    }
+
+    CBlock& operator=(const CBlock &block)
+    {
+        *((CBlockHeader*)this) = block;
+        vtx = block.vtx;
+        BlockSignature = block.BlockSignature;
+        vMerkleTree = block.vMerkleTree;
+        vchSerialized.clear();
+        return *this;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         READWRITE(*(CBlockHeader*)this);
@@ -1358,6 +1404,7 @@ public:
         vtx.clear();
         BlockSignature.clear();
         vMerkleTree.clear();
+        vchSerialized.clear();
     }
 
     CBlockHeader GetBlockHeader() const
@@ -1444,7 +1491,10 @@ public:
         if (fileOutPos < 0)
             return error("CBlock::WriteToDisk() : ftell failed");
         pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
+        if (!vchSerialized.empty() && vchSerialized.size() == nSize)
+            fileout.write(&vchSerialized[0], nSize); // as received, no need to encode it again
+        else
+            fileout << *this;
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
@@ -2280,4 +2330,102 @@ public:
     )
 };
 
+
+
+/** A transaction sent in full inside a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex; // position in the block
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** Compact block relay ("cmpctblock"): the header and PoSign signature of a
+ *  block, the coinbase in full, and short ids for the other transactions,
+ *  which the receiver rebuilds from its memory pool.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    // SipHash keys for short ids, derived from the header and nonce
+    uint64 nShortIDKey0, nShortIDKey1;
+
+    void FillShortIDKeys();
+
+public:
+    static const unsigned int SHORTTXID_SIZE = 6;
+
+    CBlockHeader header;
+    std::vector<unsigned char> BlockSignature;
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64 GetShortID(const uint256& hash) const;
+
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(BlockSignature);
+        READWRITE(nNonce);
+        // short ids go over the wire as 6 little-endian bytes each
+        std::vector<unsigned char> vBytes;
+        if (fRead) {
+            READWRITE(vBytes);
+            if (vBytes.size() % SHORTTXID_SIZE != 0)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : short id list size invalid");
+            CBlockHeaderAndShortTxIDs &us = *(const_cast<CBlockHeaderAndShortTxIDs*>(this));
+            us.vShortTxIDs.assign(vBytes.size() / SHORTTXID_SIZE, 0);
+            for (unsigned int i = 0; i < vBytes.size(); i++)
+                us.vShortTxIDs[i / SHORTTXID_SIZE] |= (uint64)vBytes[i] << (8 * (i % SHORTTXID_SIZE));
+            us.FillShortIDKeys();
+        } else {
+            vBytes.resize(vShortTxIDs.size() * SHORTTXID_SIZE);
+            for (unsigned int i = 0; i < vBytes.size(); i++)
+                vBytes[i] = (vShortTxIDs[i / SHORTTXID_SIZE] >> (8 * (i % SHORTTXID_SIZE))) & 0xff;
+            READWRITE(vBytes);
+        }
+        READWRITE(vPrefilledTxn);
+    )
+};
+
+/** Ask for the transactions of a compact block we couldn't find ("getblocktxn") */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The answer to a CBlockTransactionsRequest ("blocktxn"), in requested order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
 #endif
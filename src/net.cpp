@@ -13,6 +13,7 @@
 #ifdef WIN32
 #include <string.h>
 #endif
+#include <math.h>
 
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
@@ -29,7 +30,12 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
+// Most queued messages handed to the kernel in one sendmsg() call
+static const int MAX_SEND_IOV = 64;
+
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void RegisterNodeSocket(CNode* pnode);
+static void SignalMessageHandler(CNode* pnode);
 
 
 struct LocalServiceInfo {
@@ -52,10 +58,23 @@ uint64 nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = 1;
+
+// Bandwidth accounting and shaping
+static CCriticalSection cs_totalBytes;
+static uint64 nTotalBytesRecv = 0;
+static uint64 nTotalBytesSent = 0;
+static map<string, CMessageTypeStats> mapMessageTypeStats;
+static uint64 nMaxOutboundLimit = 0;
+static uint64 nMaxOutboundTotalBytesSentInCycle = 0;
+static int64 nMaxOutboundCycleStartTime = 0;
+// global limits, and those that apply to inbound peers only
+static CTokenBucket bucketUpload, bucketDownload;
+static CTokenBucket bucketInboundUpload, bucketInboundDownload;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedNetMessage> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -77,6 +96,217 @@ void AddOneShot(string strDest)
     vOneShots.push_back(strDest);
 }
 
+// Time in microseconds of the next event of a Poisson process with the given
+// average interval, so peers can't line up our flushes with each other
+int64 PoissonNextSend(int64 nNow, int nAverageIntervalSeconds)
+{
+    return nNow + (int64)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageIntervalSeconds * -1000000.0 + 0.5);
+}
+
+void CTokenBucket::SetRate(int64 nRateIn)
+{
+    LOCK(cs);
+    nRate = nRateIn;
+    nTokens = nRateIn;
+    nLastFill = GetTimeMicros();
+}
+
+int64 CTokenBucket::GetRate()
+{
+    LOCK(cs);
+    return nRate;
+}
+
+size_t CTokenBucket::Available()
+{
+    LOCK(cs);
+    if (nRate == 0)
+        return std::numeric_limits<size_t>::max();
+    int64 nNow = GetTimeMicros();
+    if (nNow > nLastFill)
+    {
+        nTokens = min(nRate, nTokens + (nNow - nLastFill) * nRate / 1000000);
+        nLastFill = nNow;
+    }
+    return (size_t)max(nTokens, (int64)0);
+}
+
+void CTokenBucket::Consume(size_t nBytes)
+{
+    LOCK(cs);
+    if (nRate != 0)
+        nTokens -= nBytes;
+}
+
+// Bytes pnode may send (fSend) or receive right now under the global and
+// per class limits
+static size_t BandwidthAllowance(CNode* pnode, bool fSend)
+{
+    size_t nAllowed = (fSend ? bucketUpload : bucketDownload).Available();
+    if (pnode->fInbound)
+        nAllowed = min(nAllowed, (fSend ? bucketInboundUpload : bucketInboundDownload).Available());
+    return nAllowed;
+}
+
+static void RecordBytesSent(CNode* pnode, size_t nBytes)
+{
+    bucketUpload.Consume(nBytes);
+    if (pnode->fInbound)
+        bucketInboundUpload.Consume(nBytes);
+
+    LOCK(cs_totalBytes);
+    nTotalBytesSent += nBytes;
+
+    int64 nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // a new cycle
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += nBytes;
+}
+
+static void RecordBytesRecv(CNode* pnode, size_t nBytes)
+{
+    bucketDownload.Consume(nBytes);
+    if (pnode->fInbound)
+        bucketInboundDownload.Consume(nBytes);
+
+    LOCK(cs_totalBytes);
+    nTotalBytesRecv += nBytes;
+}
+
+static void InitBandwidthLimits()
+{
+    bucketUpload.SetRate(GetArg("-maxuploadrate", 0) * 1000);
+    bucketDownload.SetRate(GetArg("-maxdownloadrate", 0) * 1000);
+    bucketInboundUpload.SetRate(GetArg("-maxinbounduploadrate", 0) * 1000);
+    bucketInboundDownload.SetRate(GetArg("-maxinbounddownloadrate", 0) * 1000);
+
+    LOCK(cs_totalBytes);
+    nMaxOutboundLimit = GetArg("-maxuploadtarget", 0) * 1024 * 1024;
+}
+
+uint64 GetTotalBytesRecv()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesRecv;
+}
+
+uint64 GetTotalBytesSent()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesSent;
+}
+
+void GetBandwidthLimits(CBandwidthLimits& limits)
+{
+    limits.nUploadRate = bucketUpload.GetRate();
+    limits.nDownloadRate = bucketDownload.GetRate();
+    limits.nInboundUploadRate = bucketInboundUpload.GetRate();
+    limits.nInboundDownloadRate = bucketInboundDownload.GetRate();
+}
+
+void GetMessageTypeStats(map<string, CMessageTypeStats>& mapStats)
+{
+    LOCK(cs_totalBytes);
+    mapStats = mapMessageTypeStats;
+}
+
+// Commands peers may send us; anything else is counted as "*other*" so a
+// peer can't grow the per-command maps without bound
+static const char* ppszKnownCommands[] =
+{
+    "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders",
+    "headers", "tx", "block", "merkleblock", "notfound", "getaddr", "mempool",
+    "ping", "pong", "alert", "filterload", "filteradd", "filterclear",
+    "cmpctblock", "getblocktxn", "blocktxn"
+};
+
+static const string& MessageStatsKey(const string& strCommand)
+{
+    static const string strOther("*other*");
+    for (unsigned int i = 0; i < ARRAYLEN(ppszKnownCommands); i++)
+        if (strCommand == ppszKnownCommands[i])
+            return strCommand;
+    return strOther;
+}
+
+void RecordMessageProcessed(CNode* pnode, const string& strCommandIn, unsigned int nBytes, int64 nMicros)
+{
+    const string& strCommand = MessageStatsKey(strCommandIn);
+    {
+        LOCK(pnode->cs_msgStats);
+        pnode->mapRecvBytesPerMsgCmd[strCommand] += nBytes;
+    }
+    LOCK(cs_totalBytes);
+    CMessageTypeStats& stats = mapMessageTypeStats[strCommand];
+    stats.nMsgsRecv++;
+    stats.nBytesRecv += nBytes;
+    stats.nProcessMicros += nMicros;
+}
+
+void CNode::RecordMessageSent(const CSerializeData& msg)
+{
+    // The command is the zero padded field after the message start
+    const char* pszCommand = &msg[CMessageHeader::MESSAGE_START_SIZE];
+    string strCommand(pszCommand, std::find(pszCommand, pszCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    {
+        LOCK(cs_msgStats);
+        mapSendBytesPerMsgCmd[strCommand] += msg.size();
+    }
+    LOCK(cs_totalBytes);
+    CMessageTypeStats& stats = mapMessageTypeStats[strCommand];
+    stats.nMsgsSent++;
+    stats.nBytesSent += msg.size();
+}
+
+uint64 GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytes);
+    return nMaxOutboundLimit;
+}
+
+uint64 GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+    int64 nCycleEnd = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    int64 nNow = GetTime();
+    return (nCycleEnd < nNow) ? 0 : nCycleEnd - nNow;
+}
+
+uint64 GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+bool OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < GetTime())
+        return false; // the cycle is over, the next send starts a new one
+
+    uint64 nReserve = 0;
+    if (fHistoricalBlockServingLimit)
+    {
+        // Keep enough to relay a day of full blocks, but never more than
+        // half the budget so historical serving isn't shut off outright
+        nReserve = min((uint64)MAX_UPLOAD_TIMEFRAME / GetTargetSpacing() * MAX_BLOCK_SIZE, nMaxOutboundLimit / 2);
+    }
+    return nMaxOutboundTotalBytesSentInCycle + nReserve >= nMaxOutboundLimit;
+}
+
 unsigned short GetListenPort()
 {
     return (unsigned short)(GetArg("-port", GetDefaultPort()));
@@ -502,6 +732,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -590,16 +821,15 @@ bool CNode::Misbehaving(int howmuch)
         return false;
     }
 
+    // Message handlers call this concurrently
+    LOCK(cs_setBanned);
     nMisbehavior += howmuch;
     if (nMisbehavior >= GetArg("-banscore", 100))
     {
         int64 banTime = GetTime()+GetArg("-bantime", 60*60*24);  // Default 24-hour ban
         printf("Misbehaving: %s (%d -> %d) DISCONNECTING\n", addr.ToString().c_str(), nMisbehavior-howmuch, nMisbehavior);
-        {
-            LOCK(cs_setBanned);
-            if (setBanned[addr] < banTime)
-                setBanned[addr] = banTime;
-        }
+        if (setBanned[addr] < banTime)
+            setBanned[addr] = banTime;
         CloseSocketDisconnect();
         return true;
     } else
@@ -609,6 +839,7 @@ bool CNode::Misbehaving(int howmuch)
 
 #undef X
 #define X(name) stats.name = name
+// requires cs_main for the block download fields
 void CNode::copyStats(CNodeStats &stats)
 {
     X(nServices);
@@ -620,17 +851,30 @@ void CNode::copyStats(CNodeStats &stats)
     X(cleanSubVer);
     X(fInbound);
     X(nStartingHeight);
-    X(nMisbehavior);
+    {
+        LOCK(cs_setBanned);
+        X(nMisbehavior);
+    }
     X(nSendBytes);
     X(nRecvBytes);
     X(nBlocksRequested);
     stats.fSyncNode = (this == pnodeSync);
+    {
+        LOCK(cs_msgStats);
+        X(mapSendBytesPerMsgCmd);
+        X(mapRecvBytesPerMsgCmd);
+    }
+    stats.vBlocksInFlight.assign(setBlocksInFlight.begin(), setBlocksInFlight.end());
+    X(nBlocksDownloaded);
+    X(dBlockRate);
+    X(nBlockStalls);
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    bool fComplete = false;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
@@ -652,11 +896,77 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         pch += handled;
         nBytes -= handled;
+        fComplete |= msg.complete();
     }
 
+    // wake a message handler as soon as a full message is buffered
+    if (fComplete)
+        SignalMessageHandler(this);
+
     return true;
 }
 
+//
+// Spare receive buffers. A message's data buffer is taken from here when its
+// header arrives and given back when the message is destroyed, so a busy
+// connection keeps reusing the same few buffers instead of allocating (and
+// zeroing) one per message. The pool is capped so a peer can't make us hold
+// on to large amounts of memory.
+//
+static std::vector<CSerializeData> vRecvBufferPool;
+static size_t nRecvBufferPoolBytes = 0;
+static CCriticalSection cs_vRecvBufferPool;
+
+static void GetRecvBuffer(CDataStream& vRecv, unsigned int nSize)
+{
+    {
+        LOCK(cs_vRecvBufferPool);
+        if (!vRecvBufferPool.empty())
+        {
+            // smallest buffer that fits, else the biggest we have
+            unsigned int nBest = 0;
+            for (unsigned int i = 1; i < vRecvBufferPool.size(); i++)
+            {
+                size_t nCap = vRecvBufferPool[i].capacity(), nBestCap = vRecvBufferPool[nBest].capacity();
+                if (nBestCap < nSize ? nCap > nBestCap : (nCap >= nSize && nCap < nBestCap))
+                    nBest = i;
+            }
+            nRecvBufferPoolBytes -= vRecvBufferPool[nBest].capacity();
+            vRecv.swap_data(vRecvBufferPool[nBest]);
+            vRecvBufferPool[nBest].swap(vRecvBufferPool.back());
+            vRecvBufferPool.pop_back();
+        }
+    }
+    vRecv.clear();
+    vRecv.reserve(std::min(nSize, RECV_BUFFER_MAX_RESERVE));
+}
+
+static void ReleaseRecvBuffer(CDataStream& vRecv)
+{
+    CSerializeData vch;
+    vRecv.swap_data(vch);
+    size_t nCap = vch.capacity();
+    if (nCap == 0)
+        return;
+    vch.clear();
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() < RECV_BUFFER_POOL_MAX_BUFFERS && nRecvBufferPoolBytes + nCap <= RECV_BUFFER_POOL_MAX_BYTES)
+    {
+        nRecvBufferPoolBytes += nCap;
+        if (vRecvBufferPool.capacity() == 0)
+            vRecvBufferPool.reserve(RECV_BUFFER_POOL_MAX_BUFFERS);
+        vRecvBufferPool.push_back(CSerializeData());
+        vRecvBufferPool.back().swap(vch);
+    }
+    // otherwise vch is wiped and freed on the way out
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -684,7 +994,9 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    GetRecvBuffer(vRecv, hdr.nMessageSize);
+    if (hdr.nMessageSize == 0)
+        finishData();
 
     return nCopy;
 }
@@ -694,12 +1006,24 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // append rather than resize up front, so the buffer is never zero-filled
+    vRecv.write(pch, nCopy);
+    hasher.write(pch, nCopy);
     nDataPos += nCopy;
+    if (nDataPos == hdr.nMessageSize)
+        finishData();
 
     return nCopy;
 }
 
+// The checksum is worked out here on the socket thread as the data comes in,
+// so the message handler doesn't have to hash the whole payload again.
+void CNetMessage::finishData()
+{
+    uint256 hash = hasher.GetHash();
+    memcpy(&nDataChecksum, &hash, sizeof(nDataChecksum));
+}
+
 
 
 
@@ -711,29 +1035,79 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedNetMessage>::iterator it = pnode->vSendMsg.begin();
+    bool fSendBufferFull = pnode->nSendSize >= SendBufferSize();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        // Don't send more than the upload limits allow right now; whoever
+        // services the socket comes back once tokens have accrued
+        size_t nAllowed = BandwidthAllowance(pnode, true);
+        if (nAllowed == 0)
+            break;
+
+        // Gather as many queued messages as fit into one call
+        size_t nRequested = 0;
+#ifdef WIN32
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        nRequested = min(data.size() - pnode->nSendOffset, nAllowed);
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSharedNetMessage>::iterator mi = it; mi != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV && nRequested < nAllowed; mi++, nIov++) {
+            const CSerializeData &data = **mi;
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = min(data.size() - nOffset, nAllowed - nRequested);
+            nRequested += iov[nIov].iov_len;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            pnode->fSocketWritable = true;
+            RecordBytesSent(pnode, nBytes);
+
+            // Retire what went out; the remainder of a partly sent message stays at the front
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nSize = (*it)->size();
+                size_t nLeft = nSize - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= nSize;
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+
+            if ((size_t)nBytes < nRequested) {
+#ifdef USE_EPOLL
+                // edge-triggered: keep writing until the kernel tells us
+                // it would block, or we won't get another writable event
+                continue;
+#else
+                // could not send everything; stop sending more
                 break;
+#endif
             }
         } else {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                if (nErr == WSAEWOULDBLOCK)
+                    pnode->fSocketWritable = false;
+                else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
                     printf("socket send error %d\n", nErr);
                     pnode->CloseSocketDisconnect();
@@ -749,73 +1123,571 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // message processing for this node stalls on a full send buffer
+    if (fSendBufferFull && pnode->nSendSize < SendBufferSize())
+        SignalMessageHandler(pnode);
 }
 
 static list<CNode*> vNodesDisconnected;
 
+#ifdef USE_EPOLL
+// Event loop state. Listen sockets are registered with a NULL tag, the wakeup
+// eventfd with &hSocketWakeup, and node sockets with their CNode.
+static int hEpoll = -1;
+static int hSocketWakeup = -1;
+static const int MAX_SOCKET_EVENTS = 256;
+
+// Nodes that asked for their send queue to be flushed, each listed once while
+// its fSocketWakeup is set. cs_vNodesWakeup is a leaf lock; a node is taken
+// off the list before it is deleted.
+static CCriticalSection cs_vNodesWakeup;
+static vector<CNode*> vNodesWakeup;
+
+static void RegisterNodeSocket(CNode* pnode)
+{
+    if (hEpoll < 0 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) < 0)
+    {
+        printf("epoll_ctl add failed for %s, error %d\n", pnode->addrName.c_str(), errno);
+        pnode->CloseSocketDisconnect();
+    }
+}
+
+static void ShutdownSocketHandler()
+{
+    if (hSocketWakeup >= 0)
+        close(hSocketWakeup);
+    if (hEpoll >= 0)
+        close(hEpoll);
+    hSocketWakeup = -1;
+    hEpoll = -1;
+}
+
+static bool InitSocketHandler()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    hSocketWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hEpoll < 0 || hSocketWakeup < 0)
+    {
+        ShutdownSocketHandler();
+        return error("InitSocketHandler() : unable to create epoll instance, error %d", errno);
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = &hSocketWakeup;
+    bool fOk = (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocketWakeup, &event) == 0);
+
+    // Listen sockets stay level-triggered, we accept until the backlog is empty
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        fOk = fOk && (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == 0);
+    }
+    if (!fOk)
+    {
+        ShutdownSocketHandler();
+        return error("InitSocketHandler() : epoll_ctl failed, error %d", errno);
+    }
+    return true;
+}
+
+void WakeSocketHandler()
+{
+    if (hSocketWakeup < 0)
+        return;
+    uint64_t nOne = 1;
+    if (write(hSocketWakeup, &nOne, sizeof(nOne)) < 0 && errno != EAGAIN)
+        printf("WakeSocketHandler() : write failed, error %d\n", errno);
+}
+
+void RequestSocketFlush(CNode* pnode)
+{
+    {
+        LOCK(cs_vNodesWakeup);
+        if (pnode->fSocketWakeup)
+            return;
+        pnode->fSocketWakeup = true;
+        vNodesWakeup.push_back(pnode);
+    }
+    WakeSocketHandler();
+}
+#else
+static void RegisterNodeSocket(CNode* pnode)
+{
+}
+
+void WakeSocketHandler()
+{
+}
+
+void RequestSocketFlush(CNode* pnode)
+{
+}
+#endif
+
+//
+// Message handler work queue. A node sits in vNodesReady at most once, and
+// only one worker handles it at a time so its messages are processed in order;
+// peers themselves are processed in parallel. A queued node is not deleted
+// (see DisconnectNodes). mutexMessageHandler is a leaf lock.
+//
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static deque<CNode*> vNodesReady;
+
+static void QueueMessageHandler(CNode* pnode, bool fSendTrickle)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+        pnode->fMsgSendTrickle |= fSendTrickle;
+        if (pnode->fMsgQueued)
+        {
+            // picked up again by the worker that has it
+            pnode->fMsgRequeue = true;
+            return;
+        }
+        pnode->fMsgQueued = true;
+        vNodesReady.push_back(pnode);
+    }
+    condMessageHandler.notify_one();
+}
+
+static void SignalMessageHandler(CNode* pnode)
+{
+    QueueMessageHandler(pnode, false);
+}
+
+static void DisconnectNodes()
+{
+    LOCK(cs_vNodes);
+    // Disconnect unused nodes
+    vector<CNode*> vNodesCopy = vNodes;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->fDisconnect || pnode->IsDuplicated() ||
+            (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+        {
+            // remove from vNodes
+            vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+            // release outbound grant (if any)
+            pnode->grantOutbound.Release();
+
+            // close socket and cleanup
+            pnode->CloseSocketDisconnect();
+            pnode->Cleanup();
+
+            // hold in disconnected pool until all refs are released
+            if (pnode->fNetworkNode || pnode->fInbound)
+                pnode->Release();
+            vNodesDisconnected.push_back(pnode);
+        }
+    }
+
+    // Delete disconnected nodes, once FinalizeDisconnectedNodes is done with them
+    list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+    BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+    {
+        // wait until threads are done using it
+        if (pnode->GetRefCount() <= 0 && pnode->fFinalized)
+        {
+            bool fDelete = false;
+            {
+                boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+                if (pnode->fMsgQueued)
+                    continue;
+            }
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
+                    {
+                        TRY_LOCK(pnode->cs_inventory, lockInv);
+                        if (lockInv)
+                            fDelete = true;
+                    }
+                }
+            }
+            if (fDelete)
+            {
+#ifdef USE_EPOLL
+                {
+                    LOCK(cs_vNodesWakeup);
+                    if (pnode->fSocketWakeup)
+                        vNodesWakeup.erase(remove(vNodesWakeup.begin(), vNodesWakeup.end(), pnode), vNodesWakeup.end());
+                }
+#endif
+                vNodesDisconnected.remove(pnode);
+                delete pnode;
+            }
+        }
+    }
+}
+
+// Accept one connection from a listen socket, returns false if there was none waiting
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterNodeSocket(pnode);
+    }
+    return true;
+}
+
+// Read once from the socket into the node's receive buffer; requires LOCK(cs_vRecvMsg).
+// Returns false once the socket has no more data for now.
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    size_t nAllowed = min(sizeof(pchBuf), BandwidthAllowance(pnode, false));
+    if (nAllowed == 0)
+        return true; // over the download limit, try again later
+    int nBytes = recv(pnode->hSocket, pchBuf, nAllowed, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        RecordBytesRecv(pnode, nBytes);
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// requires LOCK(cs_vRecvMsg)
+static bool ReceiveBufferHasRoom(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// Move a node's socket forward as far as its readiness allows.
+// Returns false when there is nothing left to do until the next event.
+static bool ServiceNodeSocket(CNode* pnode, bool& fProgress)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+
+    bool fMore = false;
+
+    //
+    // Receive, one buffer per pass so a busy peer can't starve the others
+    //
+    if (pnode->fSocketReadable)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && ReceiveBufferHasRoom(pnode) && BandwidthAllowance(pnode, false) > 0)
+        {
+            pnode->fSocketReadable = SocketRecvData(pnode);
+            fProgress |= pnode->fSocketReadable;
+        }
+        // otherwise wait for the message handler to drain the buffer, or
+        // for the download limit to let more in
+        fMore |= pnode->fSocketReadable;
+    }
+
+    //
+    // Send
+    //
+    if (pnode->hSocket == INVALID_SOCKET)
+        return false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            if (pnode->fSocketWriteEvent)
+            {
+                pnode->fSocketWritable = true;
+                pnode->fSocketWriteEvent = false;
+            }
+            if (pnode->fSocketWritable && !pnode->vSendMsg.empty())
+                SocketSendData(pnode);
+            // still writable with data queued means the upload limit held it back
+            if (pnode->fSocketWritable && !pnode->vSendMsg.empty())
+                fMore = true;
+        }
+        else if (pnode->fSocketWriteEvent)
+            fMore = true;
+    }
+
+    return fMore && pnode->hSocket != INVALID_SOCKET;
+}
+
 void ThreadSocketHandler()
 {
+    if (hEpoll < 0)
+        return;
+
     unsigned int nPrevNodeCount = 0;
+    int64 nLastInactivityCheck = 0;
+    vector<CNode*> vNodesPending; // nodes with events left to service, each holds a reference
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nTimeout = 0;
     loop
     {
         //
         // Disconnect nodes
         //
+        DisconnectNodes();
+        if (vNodes.size() != nPrevNodeCount)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-            {
-                if (pnode->fDisconnect || pnode->IsDuplicated() ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+            nPrevNodeCount = vNodes.size();
+            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+        //
+        // Wait for socket events, without blocking while there is still data we can move
+        //
+        int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
             }
+            nEvents = 0;
+        }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        bool fAccept = false;
+        bool fWakeup = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == NULL)
+                fAccept = true;
+            else if (ptr == &hSocketWakeup)
+            {
+                uint64_t nCount;
+                while (read(hSocketWakeup, &nCount, sizeof(nCount)) > 0)
+                    ;
+                fWakeup = true;
+            }
+            else
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                CNode* pnode = (CNode*)ptr;
+                // errors and hangups are picked up by the next recv
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                    pnode->fSocketReadable = true;
+                if (events[i].events & EPOLLOUT)
+                    pnode->fSocketWriteEvent = true;
+                if (!pnode->fSocketPending)
                 {
-                    bool fDelete = false;
+                    pnode->fSocketPending = true;
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
+                        LOCK(cs_vNodes);
+                        pnode->AddRef();
                     }
-                    if (fDelete)
+                    vNodesPending.push_back(pnode);
+                }
+            }
+        }
+
+        // Pick up nodes that asked for their send queue to be flushed
+        if (fWakeup)
+        {
+            vector<CNode*> vNodesFlush;
+            {
+                LOCK(cs_vNodesWakeup);
+                vNodesFlush.swap(vNodesWakeup);
+                BOOST_FOREACH(CNode* pnode, vNodesFlush)
+                    pnode->fSocketWakeup = false;
+            }
+            if (!vNodesFlush.empty())
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodesFlush)
+                {
+                    if (!pnode->fSocketPending)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        pnode->fSocketPending = true;
+                        pnode->AddRef();
+                        vNodesPending.push_back(pnode);
                     }
                 }
             }
         }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET)
+                    while (AcceptConnection(hListenSocket))
+                        boost::this_thread::interruption_point();
+        }
+
+        //
+        // Service sockets that have something to do
+        //
+        bool fProgress = false;
+        vector<CNode*> vNodesDone;
+        vector<CNode*> vNodesStillPending;
+        BOOST_FOREACH(CNode* pnode, vNodesPending)
+        {
+            boost::this_thread::interruption_point();
+            if (ServiceNodeSocket(pnode, fProgress))
+                vNodesStillPending.push_back(pnode);
+            else
+            {
+                pnode->fSocketPending = false;
+                vNodesDone.push_back(pnode);
+            }
+        }
+        vNodesPending.swap(vNodesStillPending);
+
+        //
+        // Inactivity checking
+        //
+        vector<CNode*> vNodesCopy;
+        if (GetTime() != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            InactivityCheck(pnode);
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
+                pnode->Release();
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+
+        // Poll again straight away while reads are outstanding, back off
+        // while nodes wait on locks or a full receive buffer, and otherwise
+        // sleep until an event, a wakeup, or the next housekeeping pass.
+        if (fProgress)
+            nTimeout = 0;
+        else if (!vNodesPending.empty())
+            nTimeout = 10;
+        else
+            nTimeout = 50;
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes();
         if (vNodes.size() != nPrevNodeCount)
         {
             nPrevNodeCount = vNodes.size();
@@ -869,18 +1741,19 @@ void ThreadSocketHandler()
                 // * We send some data.
                 // * We wait for data to be received (and disconnect after timeout).
                 // * We process a message in the buffer (message handler thread).
+                // Sockets held back by the bandwidth limits sit out until
+                // the next poll.
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
                     if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                        if (BandwidthAllowance(pnode, true) > 0)
+                            FD_SET(pnode->hSocket, &fdsetSend);
                         continue;
                     }
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && ReceiveBufferHasRoom(pnode) && BandwidthAllowance(pnode, false) > 0)
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -909,59 +1782,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -987,38 +1809,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1036,26 +1827,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1066,6 +1838,7 @@ void ThreadSocketHandler()
         MilliSleep(10);
     }
 }
+#endif
 
 
 
@@ -1323,6 +2096,11 @@ void DumpAddresses()
     int64 nStart = GetTimeMillis();
 
     CAddrDB adb;
+    if (adb.Append(addrman))
+    {
+        printf("Appended address changes to peers.log  %"PRI64d"ms\n", GetTimeMillis() - nStart);
+        return;
+    }
     adb.Write(addrman);
 
     printf("Flushed %d addresses to peers.dat  %"PRI64d"ms\n",
@@ -1597,11 +2375,42 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Run FinalizeNode for disconnected nodes nobody uses any more, so the socket
+// thread can delete them. This needs cs_main, which the socket thread could
+// only try for, and rarely gets while blocks are being processed.
+static void FinalizeDisconnectedNodes()
+{
+    vector<CNode*> vFinalize;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnected)
+            if (!pnode->fFinalized && pnode->GetRefCount() <= 0)
+                vFinalize.push_back(pnode);
+    }
+    if (vFinalize.empty())
+        return;
+
+    LOCK(cs_main);
+    BOOST_FOREACH(CNode* pnode, vFinalize)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (pnode->fMsgQueued)
+                continue;
+        }
+        FinalizeNode(pnode);
+        LOCK(cs_vNodes);
+        pnode->fFinalized = true;
+    }
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
+        FinalizeDisconnectedNodes();
+
         bool fHaveSyncNode = false;
 
         vector<CNode*> vNodesCopy;
@@ -1618,32 +2427,58 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Hand every node to the workers for its periodic SendMessages pass;
+        // nodes with new messages are queued as soon as they arrive
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (!pnode->fDisconnect)
+                QueueMessageHandler(pnode, pnode == pnodeTrickle);
+
         {
-            if (pnode->fDisconnect)
-                continue;
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
 
+        MilliSleep(100);
+    }
+}
+
+void ThreadProcessMessages()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode = NULL;
+        bool fSendTrickle = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            while (vNodesReady.empty())
+                condMessageHandler.wait(lock);
+            pnode = vNodesReady.front();
+            vNodesReady.pop_front();
+            fSendTrickle = pnode->fMsgSendTrickle;
+            pnode->fMsgSendTrickle = false;
+            pnode->fMsgRequeue = false;
+        }
+
+        bool fMore = false;
+        if (!pnode->fDisconnect)
+        {
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                LOCK(pnode->cs_vRecvMsg);
+                if (!ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                if (pnode->nSendSize < SendBufferSize())
+                {
+                    if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
+                        fMore = true;
                     }
                 }
             }
@@ -1653,19 +2488,23 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                    SendMessages(pnode, fSendTrickle);
             }
             boost::this_thread::interruption_point();
         }
 
+        // ProcessMessages handles one message per call; go to the back of
+        // the queue so a busy peer doesn't hold up the others
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+            if (!pnode->fDisconnect && (fMore || pnode->fMsgRequeue))
+            {
+                vNodesReady.push_back(pnode);
+                condMessageHandler.notify_one();
+                continue;
+            }
+            pnode->fMsgQueued = false;
         }
-
-        if (fSleep)
-            MilliSleep(100);
     }
 }
 
@@ -1829,7 +2668,7 @@ void static Discover()
         NewThread(ThreadGetMyExternalIP, NULL);
 }
 
-void StartNode(boost::thread_group& threadGroup)
+bool StartNode(boost::thread_group& threadGroup)
 {
     if (semOutbound == NULL) {
         // initialize semaphore
@@ -1840,6 +2679,13 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+    InitBandwidthLimits();
+
+#ifdef USE_EPOLL
+    if (!InitSocketHandler())
+        return false;
+#endif
+
     Discover();
 
     //
@@ -1868,9 +2714,13 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgproc", &ThreadProcessMessages));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
+
+    return true;
 }
 
 bool StopNode()
@@ -1911,6 +2761,9 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+#ifdef USE_EPOLL
+        ShutdownSocketHandler();
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1950,8 +2803,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // framed once here and shared by every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, MakeNetMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -8,13 +8,13 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
-#include "mruset.h"
 #include "limitedmap.h"
 #include "netbase.h"
 #include "protocol.h"
@@ -28,10 +28,31 @@ extern int nBestHeight;
 
 
 
+/** Maximum number of message handler worker threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Average seconds between transaction inventory flushes to an inbound peer; outbound peers get half */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transaction invs sent to a peer per flush, the rest wait for the next one */
+static const unsigned int INVENTORY_BROADCAST_MAX = 1000;
+/** Number of recent inventory hashes remembered per peer, several flushes
+ *  worth at INVENTORY_BROADCAST_MAX; about 19 KB per peer at a 1e-6 false
+ *  positive rate */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 5000;
+
+/** Maximum number of spare receive buffers kept for reuse */
+static const unsigned int RECV_BUFFER_POOL_MAX_BUFFERS = 64;
+/** Maximum total capacity of the spare receive buffers kept for reuse */
+static const size_t RECV_BUFFER_POOL_MAX_BYTES = 8 * 1024 * 1024;
+/** Most a receive buffer reserves up front on the word of a message header; larger messages grow as they arrive */
+static const unsigned int RECV_BUFFER_MAX_RESERVE = 1024 * 1024;
+/** Length of the -maxuploadtarget accounting cycle, in seconds */
+static const int64 MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
 void AddOneShot(std::string strDest);
+int64 PoissonNextSend(int64 nNow, int nAverageIntervalSeconds);
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
 void AddressCurrentlyConnected(const CService& addr);
@@ -41,9 +62,96 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
-void StartNode(boost::thread_group& threadGroup);
+bool StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeSocketHandler();
+void RequestSocketFlush(CNode* pnode);
+
+/** Token bucket that shapes traffic to a byte rate, allowing up to a second
+ *  worth of burst. A rate of 0 means unlimited. */
+class CTokenBucket
+{
+private:
+    CCriticalSection cs;
+    int64 nRate;
+    int64 nTokens;
+    int64 nLastFill; // microseconds
+
+public:
+    CTokenBucket() : nRate(0), nTokens(0), nLastFill(0) {}
+
+    void SetRate(int64 nRateIn);
+    int64 GetRate();
+    // Number of bytes that may go through right now
+    size_t Available();
+    void Consume(size_t nBytes);
+};
+
+/** Traffic totals for one message command */
+struct CMessageTypeStats
+{
+    uint64 nMsgsSent;
+    uint64 nBytesSent;
+    uint64 nMsgsRecv;
+    uint64 nBytesRecv;
+    int64 nProcessMicros; // time spent handling received messages
+
+    CMessageTypeStats() : nMsgsSent(0), nBytesSent(0), nMsgsRecv(0), nBytesRecv(0), nProcessMicros(0) {}
+};
+
+struct CBandwidthLimits
+{
+    int64 nUploadRate;
+    int64 nDownloadRate;
+    int64 nInboundUploadRate;
+    int64 nInboundDownloadRate;
+};
+
+uint64 GetTotalBytesRecv();
+uint64 GetTotalBytesSent();
+void GetBandwidthLimits(CBandwidthLimits& limits);
+void GetMessageTypeStats(std::map<std::string, CMessageTypeStats>& mapStats);
+void RecordMessageProcessed(CNode* pnode, const std::string& strCommand, unsigned int nBytes, int64 nMicros);
+/** Daily upload budget from -maxuploadtarget, in bytes; 0 means unlimited */
+uint64 GetMaxOutboundTarget();
+uint64 GetMaxOutboundTimeLeftInCycle();
+uint64 GetOutboundTargetBytesLeft();
+/** True once the upload budget is used up. With fHistoricalBlockServingLimit,
+ *  true as soon as only the reserve kept for relaying recent blocks is left. */
+bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+
+/** A complete network message, header included. Immutable once built, so one
+ *  copy can sit in the send queues of any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CSharedNetMessage;
+
+/** Fill in the payload size and checksum of a stream holding a header and payload */
+inline void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+/** Serialize and checksum a message once for sending to many peers.
+ *  Only for payloads whose encoding doesn't depend on the peer's version. */
+template<typename T>
+CSharedNetMessage MakeNetMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
 
 enum
 {
@@ -75,10 +183,11 @@ extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedNetMessage> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64> mapAlreadyAskedFor;
@@ -106,6 +215,12 @@ public:
     uint64 nRecvBytes;
     uint64 nBlocksRequested;
     bool fSyncNode;
+    std::map<std::string, uint64> mapSendBytesPerMsgCmd;
+    std::map<std::string, uint64> mapRecvBytesPerMsgCmd;
+    std::vector<uint256> vBlocksInFlight;
+    uint64 nBlocksDownloaded;
+    double dBlockRate;
+    int nBlockStalls;
 };
 
 
@@ -119,16 +234,22 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, buffer borrowed from the receive pool
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    CHashWriter hasher;             // hash of the data received so far
+    unsigned int nDataChecksum;     // checksum of the data, once complete
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        nDataChecksum = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -142,8 +263,17 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    // true once the whole message is in and its checksum matches the header
+    bool checksumValid() const
+    {
+        return complete() && nDataChecksum == hdr.nChecksum;
+    }
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+private:
+    void finishData();
 };
 
 
@@ -161,8 +291,23 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedNetMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    bool fSocketWritable; // false once a send would block, until the socket reports writable again; requires cs_vSend
+    bool fSocketWakeup; // queued for the socket handler to flush vSendMsg; requires cs_vNodesWakeup (net.cpp)
+
+    // readiness reported by the socket event loop, only touched by the socket handler thread
+    bool fSocketReadable;
+    bool fSocketWriteEvent;
+    bool fSocketPending;
+
+    // message handler queue state, requires mutexMessageHandler (net.cpp)
+    bool fMsgQueued;
+    bool fMsgRequeue;
+    bool fMsgSendTrickle;
+
+    // FinalizeNode has run since the node was disconnected, requires cs_vNodes
+    bool fFinalized;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -170,6 +315,11 @@ public:
     uint64 nRecvBytes;
     int nRecvVersion;
 
+    // per command traffic
+    std::map<std::string, uint64> mapSendBytesPerMsgCmd;
+    std::map<std::string, uint64> mapRecvBytesPerMsgCmd;
+    CCriticalSection cs_msgStats;
+
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
@@ -205,7 +355,7 @@ protected:
     // Key is IP address, value is banned-until-time
     static std::map<CNetAddr, int64> setBanned;
     static CCriticalSection cs_setBanned;
-    int nMisbehavior;
+    int nMisbehavior; // requires cs_setBanned
 
 public:
     uint256 hashContinue;
@@ -214,20 +364,31 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // block download, requires cs_main
+    std::set<uint256> setBlocksInFlight;
+    int nAnnouncedHeight;
+    int nBlocksQueued; // download queue entries this peer is the source of
+    uint64 nBlocksDownloaded;
+    double dBlockRate; // blocks per second, moving average
+    int64 nLastBlockTime;
+    int nBlockStalls;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 	uint256 hashCheckpointKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    int64 nNextInvSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -253,15 +414,30 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketWritable = true;
+        fSocketWakeup = false;
+        fSocketReadable = false;
+        fSocketWriteEvent = false;
+        fSocketPending = false;
+        fMsgQueued = false;
+        fMsgRequeue = false;
+        fMsgSendTrickle = false;
+        fFinalized = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        nAnnouncedHeight = -1;
+        nBlocksQueued = 0;
+        nBlocksDownloaded = 0;
+        dBlockRate = 0;
+        nLastBlockTime = 0;
+        nBlockStalls = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
         pfilter = new CBloomFilter();
 
         // Be shy and don't send version until we hear
@@ -327,6 +503,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrKnown);
         setAddrKnown.insert(addr);
     }
 
@@ -335,6 +512,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrKnown);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -344,7 +522,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -352,7 +530,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -422,30 +600,44 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        FinalizeMessageHeader(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%"PRIszu" bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+        ssSend.GetAndClear(*pmsg);
+        QueueSendMessage(pmsg);
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendMessage(const CSharedNetMessage& msg)
+    {
+        RecordMessageSent(*msg);
+        vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+        // Data left that the socket could take was held back by the upload
+        // limit or queued behind data the socket thread has yet to flush
+        if (!vSendMsg.empty() && fSocketWritable)
+            RequestSocketFlush(this);
+    }
+
+    /** Queue a message built with MakeNetMessage, sharing its buffer */
+    void PushMessage(const CSharedNetMessage& msg)
+    {
+        LOCK(cs_vSend);
+        if (fDebug)
+            printf("sending: %.12s (%"PRIszu" bytes, shared)\n", &(*msg)[CMessageHeader::MESSAGE_START_SIZE],
+                   msg->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendMessage(msg);
     }
 
     void PushVersion();
@@ -636,6 +828,7 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+    void RecordMessageSent(const CSerializeData& msg);
 };
 
 
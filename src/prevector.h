@@ -0,0 +1,289 @@
+// Copyright (c) 2012 The Bitcoin Developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef XFUEL_PREVECTOR_H
+#define XFUEL_PREVECTOR_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <new>
+
+#pragma pack(push, 1)
+/** STL-like vector container that stores up to N elements inline, and only
+ *  goes to the heap once it grows past that.
+ *
+ *  Elements are moved around with memcpy/memmove, so T must be a POD type.
+ *  The layout is packed: with N=28 and unsigned char elements an instance is
+ *  32 bytes and holds a standard output script without any heap allocation.
+ */
+template <unsigned int N, typename T, typename Size = uint32_t, typename Diff = int32_t>
+class prevector
+{
+public:
+    typedef Size size_type;
+    typedef Diff difference_type;
+    typedef T value_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+    typedef value_type* iterator;
+    typedef const value_type* const_iterator;
+
+private:
+    // Up to N this is the number of elements (stored in direct); above N the
+    // elements live on the heap and this is their number plus N + 1.
+    size_type _size;
+    union direct_or_indirect {
+        char direct[sizeof(T) * N];
+        struct {
+            size_type capacity;
+            char* indirect;
+        } heap;
+    } _union;
+
+    T* direct_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.direct) + pos; }
+    const T* direct_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.direct) + pos; }
+    T* indirect_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.heap.indirect) + pos; }
+    const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.heap.indirect) + pos; }
+    bool is_direct() const { return _size <= N; }
+
+    T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+    const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+
+    void change_capacity(size_type new_capacity)
+    {
+        if (new_capacity <= N) {
+            if (!is_direct()) {
+                char* indirect = _union.heap.indirect;
+                size_type n = size();
+                memcpy(_union.direct, indirect, n * sizeof(T));
+                free(indirect);
+                _size = n;
+            }
+        } else if (!is_direct()) {
+            char* new_indirect = static_cast<char*>(realloc(_union.heap.indirect, ((size_t)sizeof(T)) * new_capacity));
+            if (!new_indirect)
+                throw std::bad_alloc();
+            _union.heap.indirect = new_indirect;
+            _union.heap.capacity = new_capacity;
+        } else {
+            char* new_indirect = static_cast<char*>(malloc(((size_t)sizeof(T)) * new_capacity));
+            if (!new_indirect)
+                throw std::bad_alloc();
+            memcpy(new_indirect, _union.direct, _size * sizeof(T));
+            _union.heap.indirect = new_indirect;
+            _union.heap.capacity = new_capacity;
+            _size += N + 1;
+        }
+    }
+
+    // Grow to hold at least new_size elements, with some slack like std::vector
+    void grow(size_type new_size)
+    {
+        if (capacity() < new_size)
+            change_capacity(new_size + (new_size >> 1));
+    }
+
+    void set_size(size_type new_size)
+    {
+        _size = is_direct() ? new_size : new_size + N + 1;
+    }
+
+public:
+    prevector() : _size(0) {}
+
+    explicit prevector(size_type n) : _size(0)
+    {
+        resize(n);
+    }
+
+    prevector(size_type n, const T& val) : _size(0)
+    {
+        change_capacity(n);
+        set_size(n);
+        std::fill(item_ptr(0), item_ptr(n), val);
+    }
+
+    template<typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : _size(0)
+    {
+        assign(first, last);
+    }
+
+    prevector(const prevector& other) : _size(0)
+    {
+        assign(other.begin(), other.end());
+    }
+
+    ~prevector()
+    {
+        if (!is_direct())
+            free(_union.heap.indirect);
+    }
+
+    prevector& operator=(const prevector& other)
+    {
+        if (&other != this)
+            assign(other.begin(), other.end());
+        return *this;
+    }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        size_type n = std::distance(first, last);
+        if (capacity() < n)
+            change_capacity(n);
+        set_size(n);
+        std::copy(first, last, item_ptr(0));
+    }
+
+    size_type size() const { return is_direct() ? _size : _size - N - 1; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return is_direct() ? N : _union.heap.capacity; }
+    size_type max_size() const { return ((size_type)-1) - N - 1; }
+
+    iterator begin() { return item_ptr(0); }
+    const_iterator begin() const { return item_ptr(0); }
+    iterator end() { return item_ptr(size()); }
+    const_iterator end() const { return item_ptr(size()); }
+
+    T& operator[](size_type pos) { return *item_ptr(pos); }
+    const T& operator[](size_type pos) const { return *item_ptr(pos); }
+    T& front() { return *item_ptr(0); }
+    const T& front() const { return *item_ptr(0); }
+    T& back() { return *item_ptr(size() - 1); }
+    const T& back() const { return *item_ptr(size() - 1); }
+    T* data() { return item_ptr(0); }
+    const T* data() const { return item_ptr(0); }
+
+    void reserve(size_type new_capacity)
+    {
+        if (new_capacity > capacity())
+            change_capacity(new_capacity);
+    }
+
+    void shrink_to_fit()
+    {
+        change_capacity(size());
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    void resize(size_type new_size, const T& val = T())
+    {
+        size_type cur_size = size();
+        if (new_size > cur_size) {
+            grow(new_size);
+            set_size(new_size);
+            std::fill(item_ptr(cur_size), item_ptr(new_size), val);
+        } else {
+            set_size(new_size);
+        }
+    }
+
+    iterator insert(iterator pos, const T& value)
+    {
+        size_type p = pos - begin();
+        T copy = value; // value may live inside this container
+        size_type new_size = size() + 1;
+        grow(new_size);
+        T* ptr = item_ptr(p);
+        memmove(ptr + 1, ptr, (size() - p) * sizeof(T));
+        set_size(new_size);
+        *ptr = copy;
+        return ptr;
+    }
+
+    void insert(iterator pos, size_type count, const T& value)
+    {
+        size_type p = pos - begin();
+        T copy = value;
+        size_type new_size = size() + count;
+        grow(new_size);
+        T* ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        set_size(new_size);
+        std::fill(ptr, ptr + count, copy);
+    }
+
+    template<typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last)
+    {
+        size_type p = pos - begin();
+        difference_type count = std::distance(first, last);
+        size_type new_size = size() + count;
+        grow(new_size);
+        T* ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        set_size(new_size);
+        std::copy(first, last, ptr);
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        iterator p = first;
+        memmove(first, last, (end() - last) * sizeof(T));
+        set_size(size() - (last - first));
+        return p;
+    }
+
+    void push_back(const T& value)
+    {
+        T copy = value;
+        size_type new_size = size() + 1;
+        grow(new_size);
+        *item_ptr(new_size - 1) = copy;
+        set_size(new_size);
+    }
+
+    void pop_back()
+    {
+        set_size(size() - 1);
+    }
+
+    void swap(prevector& other)
+    {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    bool operator==(const prevector& other) const
+    {
+        if (other.size() != size())
+            return false;
+        return std::equal(begin(), end(), other.begin());
+    }
+
+    bool operator!=(const prevector& other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator<(const prevector& other) const
+    {
+        return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+    }
+
+    // Heap memory in use, for memory usage accounting
+    size_t allocated_memory() const
+    {
+        return is_direct() ? 0 : ((size_t)sizeof(T)) * _union.heap.capacity;
+    }
+};
+#pragma pack(pop)
+
+#endif
@@ -65,16 +65,42 @@ Value importprivkey(const Array& params, bool fHelp)
 
         if (!pwalletMain->AddKeyPubKey(key, pubkey))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-            pwalletMain->ReacceptWalletTransactions();
-        }
+    // The rescan takes cs_main and the wallet lock batch by batch, so the
+    // node and wallet stay usable meanwhile; see getrescaninfo for its progress
+    if (fRescan) {
+        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the current (or last) wallet rescan.");
+
+    LOCK(pwalletMain->cs_wallet);
+    int nStartHeight = pwalletMain->nRescanStartHeight;
+    int nHeight = pwalletMain->nRescanHeight;
+    int nStopHeight = pwalletMain->nRescanStopHeight;
+
+    Object obj;
+    obj.push_back(Pair("rescanning",  pwalletMain->fRescanning));
+    obj.push_back(Pair("startheight", nStartHeight));
+    obj.push_back(Pair("height",      nHeight));
+    obj.push_back(Pair("stopheight",  nStopHeight));
+    obj.push_back(Pair("progress",    (double)(nHeight - nStartHeight) / std::max(1, nStopHeight - nStartHeight)));
+    obj.push_back(Pair("found",       pwalletMain->nRescanFound));
+    obj.push_back(Pair("starttime",   (boost::int64_t)pwalletMain->nRescanStartTime));
+    return obj;
+}
+
 Value dumpprivkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
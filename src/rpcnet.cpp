@@ -4,6 +4,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "main.h"
 #include "net.h"
 #include "xfuelrpc.h"
 #include "alert.h"
@@ -27,7 +28,7 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
 
-    LOCK(cs_vNodes);
+    LOCK2(cs_main, cs_vNodes);
     vstats.reserve(vNodes.size());
     BOOST_FOREACH(CNode* pnode, vNodes) {
         CNodeStats stats;
@@ -69,6 +70,22 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         if (stats.fSyncNode)
             obj.push_back(Pair("syncnode", true));
+        Array inflight;
+        BOOST_FOREACH(const uint256& hash, stats.vBlocksInFlight)
+            inflight.push_back(hash.GetHex());
+        obj.push_back(Pair("inflight", inflight));
+        obj.push_back(Pair("blocksdownloaded", (boost::int64_t)stats.nBlocksDownloaded));
+        obj.push_back(Pair("blockrate", stats.dBlockRate));
+        obj.push_back(Pair("blockstalls", stats.nBlockStalls));
+
+        Object sendPerMsgCmd;
+        BOOST_FOREACH(const PAIRTYPE(std::string, uint64)& item, stats.mapSendBytesPerMsgCmd)
+            sendPerMsgCmd.push_back(Pair(item.first, (boost::int64_t)item.second));
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsgCmd));
+        Object recvPerMsgCmd;
+        BOOST_FOREACH(const PAIRTYPE(std::string, uint64)& item, stats.mapRecvBytesPerMsgCmd)
+            recvPerMsgCmd.push_back(Pair(item.first, (boost::int64_t)item.second));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
         ret.push_back(obj);
     }
@@ -76,6 +93,57 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnettotals(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnettotals\n"
+            "Returns information about network traffic, including bytes in, bytes out,\n"
+            "bandwidth limits, upload target state and per message type counters.");
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", (boost::int64_t)GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", (boost::int64_t)GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", (boost::int64_t)GetTimeMillis()));
+
+    CBandwidthLimits limits;
+    GetBandwidthLimits(limits);
+    Object limitsObj;
+    limitsObj.push_back(Pair("upload", (boost::int64_t)limits.nUploadRate));
+    limitsObj.push_back(Pair("download", (boost::int64_t)limits.nDownloadRate));
+    limitsObj.push_back(Pair("inboundupload", (boost::int64_t)limits.nInboundUploadRate));
+    limitsObj.push_back(Pair("inbounddownload", (boost::int64_t)limits.nInboundDownloadRate));
+    obj.push_back(Pair("ratelimits", limitsObj));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", (boost::int64_t)MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", (boost::int64_t)GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", (boost::int64_t)GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", (boost::int64_t)GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    map<string, CMessageTypeStats> mapStats;
+    GetMessageTypeStats(mapStats);
+    Object messages;
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageTypeStats)& item, mapStats)
+    {
+        const CMessageTypeStats& stats = item.second;
+        Object msg;
+        msg.push_back(Pair("sent", (boost::int64_t)stats.nMsgsSent));
+        msg.push_back(Pair("bytessent", (boost::int64_t)stats.nBytesSent));
+        msg.push_back(Pair("received", (boost::int64_t)stats.nMsgsRecv));
+        msg.push_back(Pair("bytesrecv", (boost::int64_t)stats.nBytesRecv));
+        msg.push_back(Pair("processtime", (double)stats.nProcessMicros / 1000000));
+        if (stats.nMsgsRecv > 0)
+            msg.push_back(Pair("avgprocesstime", (double)stats.nProcessMicros / stats.nMsgsRecv / 1000000));
+        messages.push_back(Pair(item.first, msg));
+    }
+    obj.push_back(Pair("messages", messages));
+    return obj;
+}
+
 Value addnode(const Array& params, bool fHelp)
 {
     string strCommand;
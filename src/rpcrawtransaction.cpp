@@ -493,23 +493,34 @@ Value signrawtransaction(const Array& params, bool fHelp)
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
     // Sign what we can:
+    map<unsigned int, CScript> mapPrevPubKey;
+    map<unsigned int, CScript> mapFromPubKey;
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
         CCoins coins;
         if (!view.GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
-        {
-            fComplete = false;
             continue;
-        }
-        const CScript& prevPubKey = coins.vout[txin.prevout.n].scriptPubKey;
+        mapPrevPubKey[i] = coins.vout[txin.prevout.n].scriptPubKey;
 
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            mapFromPubKey[i] = mapPrevPubKey[i];
+    }
+    SignSignatures(keystore, mapFromPubKey, mergedTx, nHashType);
+
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
+    {
+        CTxIn& txin = mergedTx.vin[i];
+        if (!mapPrevPubKey.count(i))
+        {
+            fComplete = false;
+            continue;
+        }
+        const CScript& prevPubKey = mapPrevPubKey[i];
 
-        // ... and merge in other signatures:
+        // ... merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
@@ -98,9 +98,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey, false))
@@ -415,18 +412,8 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !wtx.IsFinal())
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int nConf;
+    int64 nAmount = pwalletMain->GetReceivedByDestination(address.Get(), nMinDepth, nConf, NULL, &scriptPubKey);
 
     return  ValueFromAmount(nAmount);
 }
@@ -462,19 +449,10 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64 nAmount = 0;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
     {
-        const CWalletTx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || !wtx.IsFinal())
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-        }
+        int nConf;
+        nAmount += pwalletMain->GetReceivedByDestination(address, nMinDepth, nConf);
     }
 
     return (double)nAmount / (double)COIN;
@@ -610,6 +588,9 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    pwalletMain->IndexAccountingEntry(debit);
+    pwalletMain->IndexAccountingEntry(credit);
+
     return true;
 }
 
@@ -715,6 +696,93 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendbatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 5)
+        throw runtime_error(
+            "sendbatch <fromaccount> [{\"address\":address,\"amount\":amount},...] [minconf=1] [maxoutputs=500] [comment]\n"
+            "Pays each recipient, putting at most <maxoutputs> of them in one transaction.\n"
+            "Returns an array with, for each recipient, the txid paying it or the error that stopped it,\n"
+            "and a warning if the transaction was sent but could not be written to the wallet file.\n"
+            "amounts are double-precision floating point numbers"
+            + HelpRequiringPassphrase());
+
+    string strAccount = AccountFromValue(params[0]);
+    const Array& recipients = params[1].get_array();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    int nMaxOutputs = SEND_BATCH_MAX_OUTPUTS;
+    if (params.size() > 3)
+        nMaxOutputs = params[3].get_int();
+    if (nMaxOutputs < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maxoutputs must be positive");
+
+    CWalletTx wtx;
+    wtx.strFromAccount = strAccount;
+    if (params.size() > 4 && params[4].type() != null_type && !params[4].get_str().empty())
+        wtx.mapValue["comment"] = params[4].get_str();
+
+    vector<pair<CScript, int64> > vecSend;
+    vector<string> vstrAddress;
+    int64 totalAmount = 0;
+    BOOST_FOREACH(const Value& recipient, recipients)
+    {
+        const Object& o = recipient.get_obj();
+        RPCTypeCheck(o, map_list_of("address", str_type));
+        if (find_value(o, "amount").type() == null_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, missing amount");
+
+        string strAddress = find_value(o, "address").get_str();
+        CXFuelAddress address(strAddress);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid XFuel address: ")+strAddress);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+        int64 nAmount = AmountFromValue(find_value(o, "amount"));
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+        vstrAddress.push_back(strAddress);
+    }
+    if (vecSend.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, no recipients");
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64 nBalance = GetAccountBalance(strAccount, nMinDepth);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send
+    vector<CWalletTx> vwtx;
+    vector<string> vstrError;
+    // Sent transactions are reported even if the wallet file could not be
+    // written, so the caller doesn't pay them again
+    bool fWritten = pwalletMain->SendBatch(vecSend, wtx, vwtx, vstrError, nMaxOutputs);
+
+    Array ret;
+    for (unsigned int i = 0; i < vecSend.size(); i++)
+    {
+        unsigned int nTx = i / nMaxOutputs;
+        Object entry;
+        entry.push_back(Pair("address", vstrAddress[i]));
+        entry.push_back(Pair("amount", ValueFromAmount(vecSend[i].second)));
+        if (vstrError[nTx].empty())
+        {
+            entry.push_back(Pair("txid", vwtx[nTx].GetHash().GetHex()));
+            if (!fWritten)
+                entry.push_back(Pair("warning", "Sent, but writing the wallet file failed"));
+        }
+        else
+            entry.push_back(Pair("error", vstrError[nTx]));
+        ret.push_back(entry);
+    }
+    return ret;
+}
+
 //
 // Used by addmultisigaddress / createmultisig:
 //
@@ -844,51 +912,20 @@ Value ListReceived(const Array& params, bool fByAccounts)
     if (params.size() > 1)
         fIncludeEmpty = params[1].get_bool();
 
-    // Tally
-    map<CXFuelAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !wtx.IsFinal())
-            continue;
-
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address) || !IsMine(*pwalletMain, address))
-                continue;
-
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.txids.push_back(wtx.GetHash());
-        }
-    }
-
-    // Reply
+    // Reply, tallying each address in the address book
     Array ret;
     map<string, tallyitem> mapAccountTally;
-    BOOST_FOREACH(const PAIRTYPE(CXFuelAddress, string)& item, pwalletMain->mapAddressBook)
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, string)& item, pwalletMain->mapAddressBook)
     {
-        const CXFuelAddress& address = item.first;
+        const CXFuelAddress address(item.first);
         const string& strAccount = item.second;
-        map<CXFuelAddress, tallyitem>::iterator it = mapTally.find(address);
-        if (it == mapTally.end() && !fIncludeEmpty)
+        int nConf;
+        vector<uint256> txids;
+        int64 nAmount = pwalletMain->GetReceivedByDestination(item.first, nMinDepth, nConf, fByAccounts ? NULL : &txids);
+        bool fReceived = (nConf != std::numeric_limits<int>::max());
+        if (!fReceived && !fIncludeEmpty)
             continue;
 
-        int64 nAmount = 0;
-        int nConf = std::numeric_limits<int>::max();
-        if (it != mapTally.end())
-        {
-            nAmount = (*it).second.nAmount;
-            nConf = (*it).second.nConf;
-        }
-
         if (fByAccounts)
         {
             tallyitem& item = mapAccountTally[strAccount];
@@ -903,12 +940,9 @@ Value ListReceived(const Array& params, bool fByAccounts)
             obj.push_back(Pair("amount",        ValueFromAmount(nAmount)));
             obj.push_back(Pair("confirmations", (nConf == std::numeric_limits<int>::max() ? 0 : nConf)));
             Array transactions;
-            if (it != mapTally.end())
+            BOOST_FOREACH(const uint256& txid, txids)
             {
-                BOOST_FOREACH(const uint256& item, (*it).second.txids)
-                {
-                    transactions.push_back(item.GetHex());
-                }
+                transactions.push_back(txid.GetHex());
             }
             obj.push_back(Pair("txids", transactions));
             ret.push_back(obj);
@@ -1066,20 +1100,28 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // page backwards through the activity log until we have nCount items to return:
+    int64 nPos = std::numeric_limits<int64>::max();
+    bool fDone = false;
+    while (!fDone && nPos != -1)
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        std::vector<CWallet::TxPair> vItems;
+        nPos = pwalletMain->GetTxItemsBefore(strAccount, nPos, std::max(nCount + nFrom - (int)ret.size(), 1), vItems);
+        BOOST_FOREACH(const CWallet::TxPair& item, vItems)
+        {
+            CWalletTx *const pwtx = item.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, ret);
+            CAccountingEntry *const pacentry = item.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, ret);
+
+            if ((int)ret.size() >= (nCount+nFrom))
+            {
+                fDone = true;
+                break;
+            }
+        }
     }
     // ret is newest to oldest
 
@@ -1180,12 +1222,19 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
+    {
+        // only what's above the block, still unconfirmed, or knocked off the main chain
+        std::vector<const CWalletTx*> vwtx;
+        pwalletMain->GetTxsSinceHeight(pindex->nHeight, vwtx);
+        BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
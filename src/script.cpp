@@ -4,6 +4,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -24,20 +27,10 @@ typedef vector<unsigned char> valtype;
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
+static const CScriptNum bnFalse(0);
+static const CScriptNum bnTrue(1);
 
 bool CastToBool(const valtype& vch)
 {
@@ -364,7 +357,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -540,7 +533,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
+                    CScriptNum bn(stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -590,7 +583,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -638,7 +631,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
+                    CScriptNum bn(stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -689,7 +682,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
                     case OP_1ADD:       bn += bnOne; break;
@@ -722,9 +715,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -767,9 +760,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -867,7 +860,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -878,7 +871,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1543,7 +1536,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         bool fSolved =
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        txin.scriptSig << valtype(subscript.begin(), subscript.end());
         if (!fSolved) return false;
     }
 
@@ -1561,6 +1554,96 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
 }
 
+// One input for SignSignatures. The signature hashes are worked out before
+// any thread starts, since computing them reads the whole transaction.
+struct CSignJob
+{
+    unsigned int nIn;
+    CScript scriptPubKey;
+    uint256 hash;
+    CScript subscript;  // redeem script, if scriptPubKey is pay-to-script-hash
+    uint256 hashSub;
+    CScript scriptSig;
+    bool fSigned;
+};
+
+// Does the work SignSignature does once it has its hashes
+static void SignJobs(const CKeyStore* pkeystore, vector<CSignJob>* pvJobs, int nHashType, unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pvJobs->size(); i += nStride)
+    {
+        CSignJob& job = (*pvJobs)[i];
+        txnouttype whichType;
+        job.fSigned = Solver(*pkeystore, job.scriptPubKey, job.hash, nHashType, job.scriptSig, whichType);
+        if (job.fSigned && whichType == TX_SCRIPTHASH)
+        {
+            txnouttype subType;
+            // Solver handed back the redeem script, as already looked up in job.subscript
+            job.fSigned =
+                Solver(*pkeystore, job.subscript, job.hashSub, nHashType, job.scriptSig, subType) && subType != TX_SCRIPTHASH;
+            job.scriptSig << valtype(job.subscript.begin(), job.subscript.end());
+        }
+    }
+}
+
+static void VerifyJobs(const CTransaction* ptxTo, vector<CSignJob>* pvJobs, unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pvJobs->size(); i += nStride)
+    {
+        CSignJob& job = (*pvJobs)[i];
+        if (job.fSigned)
+            job.fSigned = VerifyScript(ptxTo->vin[job.nIn].scriptSig, job.scriptPubKey, *ptxTo, job.nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+    }
+}
+
+// Run f(0, nThreads) .. f(nThreads - 1, nThreads), the first on this thread
+static void RunStrided(const boost::function<void(unsigned int, unsigned int)>& f, unsigned int nThreads)
+{
+    boost::thread_group threadGroup;
+    for (unsigned int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(f, i, nThreads));
+    f(0, nThreads);
+    threadGroup.join_all();
+}
+
+bool SignSignatures(const CKeyStore& keystore, const map<unsigned int, CScript>& mapFromPubKey, CTransaction& txTo, int nHashType)
+{
+    vector<CSignJob> vJobs(mapFromPubKey.size());
+    unsigned int n = 0;
+    for (map<unsigned int, CScript>::const_iterator it = mapFromPubKey.begin(); it != mapFromPubKey.end(); ++it, n++)
+    {
+        CSignJob& job = vJobs[n];
+        job.nIn = (*it).first;
+        assert(job.nIn < txTo.vin.size());
+        job.scriptPubKey = (*it).second;
+        job.hash = SignatureHash(job.scriptPubKey, txTo, job.nIn, nHashType);
+        job.fSigned = false;
+
+        txnouttype whichType;
+        vector<valtype> vSolutions;
+        if (Solver(job.scriptPubKey, whichType, vSolutions) && whichType == TX_SCRIPTHASH &&
+            keystore.GetCScript(uint160(vSolutions[0]), job.subscript))
+            job.hashSub = SignatureHash(job.subscript, txTo, job.nIn, nHashType);
+    }
+
+    unsigned int nThreads = (vJobs.size() + SIGN_INPUTS_PER_THREAD - 1) / SIGN_INPUTS_PER_THREAD;
+    nThreads = std::max(1U, std::min(nThreads, (unsigned int)boost::thread::hardware_concurrency()));
+
+    RunStrided(boost::bind(&SignJobs, &keystore, &vJobs, nHashType, _1, _2), nThreads);
+
+    // Signatures go in input order, whichever thread made them
+    BOOST_FOREACH(CSignJob& job, vJobs)
+        txTo.vin[job.nIn].scriptSig.swap(job.scriptSig);
+
+    // Test solutions
+    RunStrided(boost::bind(&VerifyJobs, &txTo, &vJobs, _1, _2), nThreads);
+
+    bool fAllSigned = true;
+    BOOST_FOREACH(const CSignJob& job, vJobs)
+        fAllSigned &= job.fSigned;
+    return fAllSigned;
+}
+
 static CScript PushAll(const vector<valtype>& values)
 {
     CScript result;
@@ -1735,9 +1818,9 @@ bool CScript::IsPayToScriptHash() const
 {
     // Extra-fast test for pay-to-script-hash CScripts:
     return (this->size() == 23 &&
-            this->at(0) == OP_HASH160 &&
-            this->at(1) == 0x14 &&
-            this->at(22) == OP_EQUAL);
+            (*this)[0] == OP_HASH160 &&
+            (*this)[1] == 0x14 &&
+            (*this)[22] == OP_EQUAL);
 }
 
 class CScriptVisitor : public boost::static_visitor<bool>
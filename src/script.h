@@ -18,6 +18,7 @@ class CCoins;
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
+static const unsigned int SIGN_INPUTS_PER_THREAD = 16; // SignSignatures starts no more threads than this allows
 
 /** Signature hash types/flags */
 enum
@@ -212,11 +213,117 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+/** Errors thrown by CScriptNum */
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Numeric value on the script stack.
+ *
+ * Encoded as little-endian sign-magnitude with the sign in the top bit of the
+ * last byte, exactly like CBigNum::getvch(), but computed with native 64-bit
+ * integers. Operands are limited to nMaxNumSize bytes, so results of the
+ * arithmetic opcodes always fit; they are only range checked again when they
+ * are used as operands.
+ */
+class CScriptNum
+{
+public:
+    static const size_t nDefaultMaxNumSize = 4;
+
+    explicit CScriptNum(const int64& n) : nValue(n) {}
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch, size_t nMaxNumSize = nDefaultMaxNumSize)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        nValue = setvch(vch);
+    }
+
+    bool operator==(const int64& n) const { return nValue == n; }
+    bool operator!=(const int64& n) const { return nValue != n; }
+    bool operator<=(const int64& n) const { return nValue <= n; }
+    bool operator< (const int64& n) const { return nValue <  n; }
+    bool operator>=(const int64& n) const { return nValue >= n; }
+    bool operator> (const int64& n) const { return nValue >  n; }
+
+    bool operator==(const CScriptNum& b) const { return nValue == b.nValue; }
+    bool operator!=(const CScriptNum& b) const { return nValue != b.nValue; }
+    bool operator<=(const CScriptNum& b) const { return nValue <= b.nValue; }
+    bool operator< (const CScriptNum& b) const { return nValue <  b.nValue; }
+    bool operator>=(const CScriptNum& b) const { return nValue >= b.nValue; }
+    bool operator> (const CScriptNum& b) const { return nValue >  b.nValue; }
+
+    CScriptNum operator+(const CScriptNum& b) const { return CScriptNum(nValue + b.nValue); }
+    CScriptNum operator-(const CScriptNum& b) const { return CScriptNum(nValue - b.nValue); }
+    CScriptNum operator-() const                    { return CScriptNum(-nValue); }
+
+    CScriptNum& operator+=(const CScriptNum& b) { nValue += b.nValue; return *this; }
+    CScriptNum& operator-=(const CScriptNum& b) { nValue -= b.nValue; return *this; }
+    CScriptNum& operator=(const int64& n)       { nValue = n; return *this; }
+
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        else if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    std::vector<unsigned char> getvch() const
+    {
+        return nValue < 0 ? serialize(~(uint64)nValue + 1, true) : serialize(nValue, false);
+    }
+
+    static std::vector<unsigned char> serialize(uint64 nAbs, bool fNegative)
+    {
+        std::vector<unsigned char> vch;
+        while (nAbs)
+        {
+            vch.push_back(nAbs & 0xff);
+            nAbs >>= 8;
+        }
+
+        // The top bit of the last byte is the sign; if the magnitude already
+        // uses it, append a byte to carry the sign instead
+        if (!vch.empty())
+        {
+            if (vch.back() & 0x80)
+                vch.push_back(fNegative ? 0x80 : 0);
+            else if (fNegative)
+                vch.back() |= 0x80;
+        }
+        return vch;
+    }
+
+private:
+    static int64 setvch(const std::vector<unsigned char>& vch)
+    {
+        if (vch.empty())
+            return 0;
+
+        uint64 n = 0;
+        for (unsigned int i = 0; i < vch.size(); i++)
+            n |= (uint64)vch[i] << (8 * i);
+
+        // Negative: clear the sign bit and negate
+        if (vch.back() & 0x80)
+            return -(int64)(n & ~((uint64)0x80 << (8 * (vch.size() - 1))));
+        return (int64)n;
+    }
+
+    int64 nValue;
+};
+
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
-        return strprintf("%d", CBigNum(vch).getint());
+        return strprintf("%d", CScriptNum(vch).getint());
     else
         return HexStr(vch);
 }
@@ -241,7 +348,7 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
 
 
 /** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<unsigned char>
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64 n)
@@ -252,8 +359,7 @@ protected:
         }
         else
         {
-            CBigNum bn(n);
-            *this << bn.getvch();
+            *this << CScriptNum(n).getvch();
         }
         return *this;
     }
@@ -266,19 +372,17 @@ protected:
         }
         else
         {
-            CBigNum bn(n);
-            *this << bn.getvch();
+            *this << CScriptNum::serialize(n, false);
         }
         return *this;
     }
 
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<unsigned char>(pbegin, pend) { }
-#ifndef _MSC_VER
-    CScript(const unsigned char* pbegin, const unsigned char* pend) : std::vector<unsigned char>(pbegin, pend) { }
-#endif
+    CScript(const CScript& b) : CScriptBase(b.begin(), b.end()) { }
+    CScript& operator=(const CScript& b) { CScriptBase::operator=(b); return *this; }
+    CScript(const_iterator pbegin, const_iterator pend) : CScriptBase(pbegin, pend) { }
+    CScript(std::vector<unsigned char>::const_iterator pbegin, std::vector<unsigned char>::const_iterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -308,7 +412,7 @@ public:
 
     explicit CScript(opcodetype b)     { operator<<(b); }
     explicit CScript(const uint256& b) { operator<<(b); }
-    explicit CScript(const CBigNum& b) { operator<<(b); }
+    explicit CScript(const CScriptNum& b) { operator<<(b); }
     explicit CScript(const std::vector<unsigned char>& b) { operator<<(b); }
 
 
@@ -354,7 +458,7 @@ public:
         return *this;
     }
 
-    CScript& operator<<(const CBigNum& b)
+    CScript& operator<<(const CScriptNum& b)
     {
         *this << b.getvch();
         return *this;
@@ -678,6 +782,9 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+// Sign the inputs of txTo in mapFromPubKey, each spending the given scriptPubKey,
+// spreading the work over several threads. Returns true if all of them got signed.
+bool SignSignatures(const CKeyStore& keystore, const std::map<unsigned int, CScript>& mapFromPubKey, CTransaction& txTo, int nHashType=SIGHASH_ALL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
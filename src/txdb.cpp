@@ -73,14 +73,34 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
-bool CBlockTreeDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
+// The best invalid work is stored the way CBigNum serialized it: the
+// little-endian magnitude without trailing zero bytes, plus a zero byte
+// when the top bit of the last one is set (it would be read as the sign).
+bool CBlockTreeDB::ReadBestInvalidWork(uint256& nBestInvalidWork)
 {
-    return Read('I', bnBestInvalidWork);
+    std::vector<unsigned char> vch;
+    if (!Read('I', vch))
+        return false;
+    if (!vch.empty() && (vch.back() & 0x80))
+        return error("CBlockTreeDB::ReadBestInvalidWork() : negative value");
+    if (vch.size() >= 2 && vch.back() == 0 && (vch[vch.size() - 2] & 0x80))
+        vch.pop_back();
+    if (vch.size() > sizeof(nBestInvalidWork))
+        return error("CBlockTreeDB::ReadBestInvalidWork() : value out of range");
+    nBestInvalidWork = 0;
+    if (!vch.empty())
+        memcpy(nBestInvalidWork.begin(), &vch[0], vch.size());
+    return true;
 }
 
-bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
+bool CBlockTreeDB::WriteBestInvalidWork(const uint256& nBestInvalidWork)
 {
-    return Write('I', bnBestInvalidWork);
+    std::vector<unsigned char> vch(nBestInvalidWork.begin(), nBestInvalidWork.end());
+    while (!vch.empty() && vch.back() == 0)
+        vch.pop_back();
+    if (!vch.empty() && (vch.back() & 0x80))
+        vch.push_back(0);
+    return Write('I', vch);
 }
 
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo &info) {
@@ -166,9 +186,9 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CBlockTreeDB::WriteTxIndex(const CTxIndexList &vect) {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+    for (CTxIndexList::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair('t', it->first), it->second);
     return WriteBatch(batch);
 }
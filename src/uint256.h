@@ -297,9 +297,15 @@ public:
 
     std::string GetHex() const
     {
-        char psz[sizeof(pn)*2 + 1];
+        static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+        char psz[sizeof(pn)*2];
         for (unsigned int i = 0; i < sizeof(pn); i++)
-            sprintf(psz + i*2, "%02x", ((unsigned char*)pn)[sizeof(pn) - i - 1]);
+        {
+            unsigned char c = ((unsigned char*)pn)[sizeof(pn) - i - 1];
+            psz[i*2] = hexmap[c >> 4];
+            psz[i*2+1] = hexmap[c & 15];
+        }
         return std::string(psz, psz + sizeof(pn)*2);
     }
 
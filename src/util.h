@@ -291,17 +291,21 @@ inline int64 abs64(int64 n)
 template<typename T>
 std::string HexStr(const T itbegin, const T itend, bool fSpaces=false)
 {
-    std::string rv;
     static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
                                      '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
-    rv.reserve((itend-itbegin)*3);
+    if (!(itbegin < itend))
+        return std::string();
+
+    // Size the result once and fill it in place; separators are pre-filled
+    std::string rv((itend-itbegin) * (fSpaces ? 3 : 2) - (fSpaces ? 1 : 0), ' ');
+    char* pout = &rv[0];
     for(T it = itbegin; it < itend; ++it)
     {
         unsigned char val = (unsigned char)(*it);
         if(fSpaces && it != itbegin)
-            rv.push_back(' ');
-        rv.push_back(hexmap[val>>4]);
-        rv.push_back(hexmap[val&15]);
+            pout++;
+        *pout++ = hexmap[val>>4];
+        *pout++ = hexmap[val&15];
     }
 
     return rv;
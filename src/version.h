@@ -27,7 +27,7 @@ extern const std::string CLIENT_DATE;
 
 static const int PROTOCOL_VERSION_SHORT = 1;
 
-static const int PROTOCOL_VERSION = 10001;
+static const int PROTOCOL_VERSION = 10002;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 1;
@@ -35,5 +35,8 @@ static const int INIT_PROTO_VERSION = 1;
 // disconnect from peers older than this proto version
 static const int MIN_PEER_PROTO_VERSION = 10001;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" compact block relay starts with this version
+static const int COMPACT_BLOCKS_VERSION = 10002;
+
 
 #endif
@@ -53,6 +53,8 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteKey(pubkey, secret.GetPrivKey());
         return CWalletDB(strWalletFile).WriteKey(pubkey, secret.GetPrivKey());
     }
     return true;
@@ -68,6 +70,8 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
         LOCK(cs_wallet);
         if (pwalletdbEncryption)
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret);
+        else if (pwalletdbKeyBatch)
+            return pwalletdbKeyBatch->WriteCryptedKey(vchPubKey, vchCryptedSecret);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret);
     }
@@ -335,6 +339,237 @@ CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries,
     return txOrdered;
 }
 
+// Height a wallet transaction is indexed under in mapTxByHeight
+static const int HISTORY_HEIGHT_UNCONFIRMED = std::numeric_limits<int>::max();
+
+static int HistoryHeight(const uint256& hashBlock)
+{
+    if (hashBlock != 0)
+    {
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end())
+            return (*mi).second->nHeight;
+    }
+    return HISTORY_HEIGHT_UNCONFIRMED;
+}
+
+static bool IsBlockInMainChain(const uint256& hashBlock)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    return (mi != mapBlockIndex.end() && (*mi).second->IsInMainChain());
+}
+
+void CWallet::IndexHistory(CWalletTx* pwtx)
+{
+    wtxOrdered.insert(make_pair(pwtx->nOrderPos, TxPair(pwtx, (CAccountingEntry*)0)));
+    mapAccountOrder[pwtx->strFromAccount].insert(pwtx->nOrderPos);
+    BOOST_FOREACH(const CTxOut& txout, pwtx->vout)
+    {
+        if (!IsMine(txout))
+            continue;
+        CTxDestination address;
+        ExtractDestination(txout.scriptPubKey, address);
+        mapDestinationOrder[address].insert(pwtx->nOrderPos);
+    }
+
+    int nHeight = HistoryHeight(pwtx->hashBlock);
+    mapTxByHeight.insert(make_pair(nHeight, pwtx->GetHash()));
+    if (nHeight != HISTORY_HEIGHT_UNCONFIRMED && !IsBlockInMainChain(pwtx->hashBlock))
+        setTxOffChain.insert(pwtx->GetHash());
+}
+
+void CWallet::IndexHistory(CAccountingEntry* pacentry)
+{
+    wtxOrdered.insert(make_pair(pacentry->nOrderPos, TxPair((CWalletTx*)0, pacentry)));
+    mapAccountOrder[pacentry->strAccount].insert(pacentry->nOrderPos);
+}
+
+void CWallet::IndexAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    if (!fHistoryIndexValid)
+        return; // picked up from the database when the index is built
+    laccentries.push_back(acentry);
+    IndexHistory(&laccentries.back());
+}
+
+int64 CWallet::GetReceivedByDestination(const CTxDestination& address, int nMinDepth, int& nConfRet,
+                                       vector<uint256>* pvTxidsRet, const CScript* pscriptExact)
+{
+    nConfRet = std::numeric_limits<int>::max();
+    if (pvTxidsRet)
+        pvTxidsRet->clear();
+
+    LOCK(cs_wallet);
+    if (!::IsMine(*this, address))
+        return 0;
+    UpdateHistoryIndex();
+
+    map<CTxDestination, set<int64> >::const_iterator mi = mapDestinationOrder.find(address);
+    if (mi == mapDestinationOrder.end())
+        return 0;
+
+    int64 nAmount = 0;
+    BOOST_FOREACH(int64 nOrderPos, (*mi).second)
+    {
+        pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(nOrderPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it)
+        {
+            const CWalletTx* pwtx = (*it).second.first;
+            if (!pwtx || pwtx->IsCoinBase() || !pwtx->IsFinal())
+                continue;
+
+            int nDepth = pwtx->GetDepthInMainChain();
+            if (nDepth < nMinDepth)
+                continue;
+
+            BOOST_FOREACH(const CTxOut& txout, pwtx->vout)
+            {
+                if (pscriptExact)
+                {
+                    if (txout.scriptPubKey != *pscriptExact)
+                        continue;
+                }
+                else
+                {
+                    CTxDestination dest;
+                    if (!ExtractDestination(txout.scriptPubKey, dest) || dest != address)
+                        continue;
+                }
+                nAmount += txout.nValue;
+                nConfRet = min(nConfRet, nDepth);
+                if (pvTxidsRet)
+                    pvTxidsRet->push_back(pwtx->GetHash());
+            }
+        }
+    }
+    return nAmount;
+}
+
+// Build the history indexes if needed, and note wallet transactions whose
+// block was disconnected since the last call; requires LOCK(cs_wallet)
+void CWallet::UpdateHistoryIndex()
+{
+    if (!fHistoryIndexValid)
+    {
+        wtxOrdered.clear();
+        laccentries.clear();
+        mapAccountOrder.clear();
+        mapDestinationOrder.clear();
+        mapTxByHeight.clear();
+        setTxOffChain.clear();
+
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            IndexHistory(&(*it).second);
+        if (fFileBacked)
+            CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+        BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+            IndexHistory(&entry);
+
+        fHistoryIndexValid = true;
+        pindexHistoryTip = pindexBest;
+        return;
+    }
+
+    if (pindexHistoryTip == pindexBest)
+        return;
+
+    // Only blocks above the fork point can have left the main chain
+    const CBlockIndex* pfork = pindexHistoryTip;
+    while (pfork && !pfork->IsInMainChain())
+        pfork = pfork->pprev;
+    pindexHistoryTip = pindexBest;
+
+    multimap<int, uint256>::iterator it = mapTxByHeight.upper_bound(pfork ? pfork->nHeight : -1);
+    for (; it != mapTxByHeight.end() && (*it).first != HISTORY_HEIGHT_UNCONFIRMED; ++it)
+        if (!IsBlockInMainChain(mapWallet[(*it).second].hashBlock))
+            setTxOffChain.insert((*it).second);
+
+    // and some may have come back
+    for (set<uint256>::iterator it = setTxOffChain.begin(); it != setTxOffChain.end(); )
+    {
+        if (IsBlockInMainChain(mapWallet[*it].hashBlock))
+            setTxOffChain.erase(it++);
+        else
+            ++it;
+    }
+}
+
+int64 CWallet::GetTxItemsBefore(const std::string& strAccount, int64 nBeforePos, unsigned int nMax, std::vector<TxPair>& vItemsRet)
+{
+    LOCK(cs_wallet);
+    UpdateHistoryIndex();
+    vItemsRet.clear();
+
+    if (strAccount == "*")
+    {
+        TxItems::iterator it = wtxOrdered.lower_bound(nBeforePos);
+        while (it != wtxOrdered.begin() && vItemsRet.size() < nMax)
+            vItemsRet.push_back((*--it).second);
+        return (it == wtxOrdered.begin()) ? -1 : (*it).first;
+    }
+
+    // Merge, newest first, the positions of the account's sends and moves
+    // with those of receives to each address currently labelled with it
+    typedef std::set<int64>::const_iterator PosIter;
+    std::vector<std::pair<PosIter, PosIter> > vRanges; // (begin, one past the next position to take)
+    std::map<std::string, std::set<int64> >::const_iterator mi = mapAccountOrder.find(strAccount);
+    if (mi != mapAccountOrder.end())
+        vRanges.push_back(make_pair((*mi).second.begin(), (*mi).second.lower_bound(nBeforePos)));
+    for (std::map<CTxDestination, std::set<int64> >::const_iterator di = mapDestinationOrder.begin(); di != mapDestinationOrder.end(); ++di)
+    {
+        std::map<CTxDestination, std::string>::const_iterator ai = mapAddressBook.find((*di).first);
+        const std::string& strLabel = (ai != mapAddressBook.end()) ? (*ai).second : std::string();
+        if (strLabel == strAccount)
+            vRanges.push_back(make_pair((*di).second.begin(), (*di).second.lower_bound(nBeforePos)));
+    }
+
+    int64 nLastPos = nBeforePos;
+    while (vItemsRet.size() < nMax)
+    {
+        int nBest = -1;
+        int64 nPos = -1;
+        for (unsigned int i = 0; i < vRanges.size(); i++)
+        {
+            if (vRanges[i].second == vRanges[i].first)
+                continue;
+            PosIter itPrev = vRanges[i].second;
+            --itPrev;
+            if (nBest == -1 || *itPrev > nPos)
+            {
+                nBest = i;
+                nPos = *itPrev;
+            }
+        }
+        if (nBest == -1)
+            return -1;
+        --vRanges[nBest].second;
+        if (nPos == nLastPos)
+            continue; // in more than one range
+        nLastPos = nPos;
+        std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(nPos);
+        for (TxItems::iterator it = range.first; it != range.second; ++it)
+            vItemsRet.push_back((*it).second);
+    }
+    return nLastPos;
+}
+
+void CWallet::GetTxsSinceHeight(int nHeight, std::vector<const CWalletTx*>& vRet)
+{
+    LOCK(cs_wallet);
+    UpdateHistoryIndex();
+    vRet.clear();
+
+    for (multimap<int, uint256>::iterator it = mapTxByHeight.upper_bound(nHeight); it != mapTxByHeight.end(); ++it)
+        vRet.push_back(&mapWallet[(*it).second]);
+    BOOST_FOREACH(const uint256& hash, setTxOffChain)
+    {
+        const CWalletTx* pwtx = &mapWallet[hash];
+        if (HistoryHeight(pwtx->hashBlock) <= nHeight)
+            vRet.push_back(pwtx);
+    }
+}
+
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
 {
     // Anytime a signature is successfully verified, it's proof the outpoint is spent.
@@ -355,6 +590,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx)
                     printf("WalletUpdateSpent found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    IndexUnspent(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -368,6 +604,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fUnspentIndexValid = false;
+        fHistoryIndexValid = false;
     }
 }
 
@@ -376,6 +614,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
     uint256 hash = wtxIn.GetHash();
     {
         LOCK(cs_wallet);
+        UpdateHistoryIndex();
         // Inserts only if not already there, returns tx inserted or tx found
         pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
@@ -396,14 +635,14 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
                                 continue;
                             CAccountingEntry *const pacentry = (*it).second.second;
+                            if (pacentry && pacentry->strAccount != "")
+                                continue;
                             int64 nSmartTime;
                             if (pwtx)
                             {
@@ -431,6 +670,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                            wtxIn.GetHash().ToString().c_str(),
                            wtxIn.hashBlock.ToString().c_str());
             }
+            IndexHistory(&wtx);
         }
 
         bool fUpdated = false;
@@ -439,8 +679,25 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             // Merge
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
+                // move it in the height index
+                std::pair<multimap<int, uint256>::iterator, multimap<int, uint256>::iterator> range = mapTxByHeight.equal_range(HistoryHeight(wtx.hashBlock));
+                for (multimap<int, uint256>::iterator it = range.first; it != range.second; ++it)
+                {
+                    if ((*it).second == hash)
+                    {
+                        mapTxByHeight.erase(it);
+                        break;
+                    }
+                }
+                setTxOffChain.erase(hash);
+
                 wtx.hashBlock = wtxIn.hashBlock;
                 fUpdated = true;
+
+                int nHeight = HistoryHeight(wtx.hashBlock);
+                mapTxByHeight.insert(make_pair(nHeight, hash));
+                if (nHeight != HISTORY_HEIGHT_UNCONFIRMED && !IsBlockInMainChain(wtx.hashBlock))
+                    setTxOffChain.insert(hash);
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
             {
@@ -455,6 +712,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        IndexUnspent(hash);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -533,6 +791,8 @@ bool CWallet::EraseFromWallet(uint256 hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        fHistoryIndexValid = false;
+        IndexUnspent(hash);
     }
     return true;
 }
@@ -766,31 +1026,219 @@ void CWalletTx::AddSupportingTransactions()
 
 bool CWalletTx::WriteToDisk()
 {
+    if (pwallet->DeferTxWrite(GetHash()))
+        return true;
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+// Cheap superset of IsMine: whether the script pushes one of our keys, or the
+// hash of one of our keys or scripts. Outputs that fail this can't be ours.
+static bool ScriptMayBeMine(const CScript& script, const set<uint160>& setIDs)
+{
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    vector<unsigned char> vch;
+    while (script.GetOp(pc, opcode, vch))
+    {
+        if (vch.size() == 20)
+        {
+            if (setIDs.count(uint160(vch)))
+                return true;
+        }
+        else if (vch.size() == 33 || vch.size() == 65)
+        {
+            if (setIDs.count(Hash160(vch)))
+                return true;
+        }
+    }
+    return false;
+}
+
+/** A batch of blocks being read ahead and pre-filtered by rescan workers */
+class CRescanBatch
+{
+public:
+    struct CEntry
+    {
+        CBlockIndex* pindex;
+        CBlock block;
+        bool fRead;
+        std::vector<char> vfMaybeMine; // per transaction
+    };
+
+    std::vector<CEntry> vEntries;
+    unsigned int nNext;
+    CCriticalSection cs;
+    boost::thread_group threads;
+
+    // Queue up to RESCAN_BATCH_SIZE blocks starting at pindex, return the block after them.
+    // Requires cs_main.
+    CBlockIndex* Fill(CBlockIndex* pindex)
+    {
+        vEntries.clear();
+        nNext = 0;
+        while (pindex && vEntries.size() < RESCAN_BATCH_SIZE)
+        {
+            vEntries.push_back(CEntry());
+            vEntries.back().pindex = pindex;
+            vEntries.back().fRead = false;
+            pindex = pindex->pnext;
+        }
+        return pindex;
+    }
+
+    void Start(int nThreads, const set<uint160>* psetIDs)
+    {
+        for (int i = 0; i < nThreads && !vEntries.empty(); i++)
+            threads.create_thread(boost::bind(&CRescanBatch::Work, this, psetIDs));
+    }
+
+    void Wait()
+    {
+        threads.join_all();
+    }
+
+private:
+    void Work(const set<uint160>* psetIDs)
+    {
+        while (true)
+        {
+            unsigned int i;
+            {
+                LOCK(cs);
+                i = nNext++;
+            }
+            if (i >= vEntries.size())
+                return;
+
+            CEntry& entry = vEntries[i];
+            entry.fRead = entry.block.ReadFromDisk(entry.pindex);
+            entry.vfMaybeMine.assign(entry.block.vtx.size(), false);
+            for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+            {
+                BOOST_FOREACH(const CTxOut& txout, entry.block.vtx[j].vout)
+                {
+                    if (ScriptMayBeMine(txout.scriptPubKey, *psetIDs))
+                    {
+                        entry.vfMaybeMine[j] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and their outputs matched against our keys and scripts by
+// worker threads, one batch ahead of the batch being added to the wallet in
+// chain order. cs_main and cs_wallet are only held while the chain is walked
+// and while a batch is applied.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
+    int64 nStart = GetTimeMillis();
 
-    CBlockIndex* pindex = pindexStart;
+    set<uint160> setIDs;
     {
         LOCK(cs_wallet);
-        while (pindex)
+        set<CKeyID> setKeys;
+        GetKeys(setKeys);
+        setIDs.insert(setKeys.begin(), setKeys.end());
+        set<CScriptID> setScripts;
+        GetCScripts(setScripts);
+        setIDs.insert(setScripts.begin(), setScripts.end());
+    }
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS));
+
+    CRescanBatch batches[2];
+    CRescanBatch* pbatch = &batches[0];
+    CRescanBatch* pbatchNext = &batches[1];
+    CBlockIndex* pindex;
+    {
+        LOCK2(cs_main, cs_wallet);
+        fRescanning = true;
+        nRescanStartHeight = nRescanHeight = pindexStart ? pindexStart->nHeight : 0;
+        nRescanStopHeight = nBestHeight;
+        nRescanFound = 0;
+        nRescanStartTime = GetTime();
+        pindex = pbatch->Fill(pindexStart);
+    }
+    pbatch->Start(nThreads, &setIDs);
+    int64 nLastProgress = GetTime();
+    while (!pbatch->vEntries.empty())
+    {
+        pbatch->Wait();
         {
-            CBlock block;
-            block.ReadFromDisk(pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            LOCK(cs_main);
+            pindex = pbatchNext->Fill(pindex);
+        }
+        pbatchNext->Start(nThreads, &setIDs);
+
+        CBlockIndex* pindexStale = NULL;
+        {
+            LOCK2(cs_main, cs_wallet);
+            BOOST_FOREACH(CRescanBatch::CEntry& entry, pbatch->vEntries)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
+                // A reorganization took this block out of the main chain
+                if (!entry.pindex->IsInMainChain())
+                {
+                    pindexStale = entry.pindex;
+                    break;
+                }
+                for (unsigned int j = 0; j < entry.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = entry.block.vtx[j];
+                    uint256 hash = tx.GetHash();
+
+                    // Anything else is only of interest if it spends one of
+                    // our transactions (possibly one found earlier in the scan)
+                    bool fRelevant = entry.vfMaybeMine[j] || mapWallet.count(hash);
+                    for (unsigned int k = 0; k < tx.vin.size() && !fRelevant; k++)
+                        fRelevant = mapWallet.count(tx.vin[k].prevout.hash);
+                    if (!fRelevant)
+                        continue;
+
+                    if (AddToWalletIfInvolvingMe(hash, tx, &entry.block, fUpdate))
+                        ret++;
+                }
+                nRescanHeight = entry.pindex->nHeight;
             }
-            pindex = pindex->pnext;
+            nRescanFound = ret;
+        }
+
+        if (pindexStale)
+        {
+            // The batch read ahead follows the old chain too; carry on from
+            // where it forks off the main chain
+            pbatchNext->Wait();
+            LOCK(cs_main);
+            CBlockIndex* pindexFork = pindexStale;
+            while (!pindexFork->IsInMainChain())
+                pindexFork = pindexFork->pprev;
+            printf("ScanForWalletTransactions() : chain reorganized, continuing from block %d\n", pindexFork->nHeight);
+            pindex = pbatchNext->Fill(pindexFork->pnext);
+            pbatchNext->Start(nThreads, &setIDs);
+        }
+
+        if (GetTime() - nLastProgress >= 60)
+        {
+            nLastProgress = GetTime();
+            printf("Still rescanning. At block %d. Progress=%f\n", nRescanHeight,
+                   (double)(nRescanHeight - nRescanStartHeight) / std::max(1, nRescanStopHeight - nRescanStartHeight));
         }
+        std::swap(pbatch, pbatchNext);
     }
+    {
+        LOCK(cs_wallet);
+        fRescanning = false;
+    }
+
+    printf("ScanForWalletTransactions() : %d transactions found from block %d to %d  %"PRI64d"ms\n",
+           ret, nRescanStartHeight, nRescanHeight, GetTimeMillis() - nStart);
     return ret;
 }
 
@@ -830,6 +1278,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %sbc %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    IndexUnspent(item.first);
                 }
             }
             else
@@ -920,49 +1369,107 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Recompute the index entry of one wallet transaction; requires LOCK(cs_wallet)
+void CWallet::IndexUnspent(const uint256& hash) const
 {
-    int64 nTotal = 0;
+    if (!fUnspentIndexValid)
+        return; // rebuilt from scratch on next use
+
+    map<uint256, CUnspentEntry>::iterator mi = mapUnspent.find(hash);
+    if (mi != mapUnspent.end())
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        nUnspentCredit[(*mi).second.nState] -= (*mi).second.nCredit;
+        mapUnspent.erase(mi);
     }
 
-    return nTotal;
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
+    const CWalletTx& wtx = (*it).second;
+
+    bool fUnspent = false;
+    for (unsigned int i = 0; i < wtx.vout.size() && !fUnspent; i++)
+        fUnspent = !wtx.IsSpent(i) && IsMine(wtx.vout[i]);
+    if (!fUnspent)
+        return;
+
+    CUnspentEntry entry;
+    if (wtx.IsCoinBase() && wtx.GetBlocksToMaturity() > 0)
+    {
+        entry.nState = UNSPENT_IMMATURE;
+        entry.nCredit = wtx.GetImmatureCredit(false);
+    }
+    else
+    {
+        if (!wtx.IsFinal())
+            entry.nState = UNSPENT_NONFINAL;
+        else if (wtx.IsConfirmed())
+            entry.nState = UNSPENT_CONFIRMED;
+        else
+            entry.nState = UNSPENT_UNCONFIRMED;
+        entry.nCredit = wtx.GetAvailableCredit(false);
+    }
+    // Confirmed in a block stays confirmed while the chain only grows
+    entry.fVolatile = (entry.nState != UNSPENT_CONFIRMED || wtx.GetDepthInMainChain() < 1);
+
+    mapUnspent.insert(make_pair(hash, entry));
+    nUnspentCredit[entry.nState] += entry.nCredit;
 }
 
-int64 CWallet::GetUnconfirmedBalance() const
+// Bring the unspent index up to date with the best chain; requires LOCK(cs_wallet)
+void CWallet::UpdateUnspentIndex() const
 {
-    int64 nTotal = 0;
+    if (!fUnspentIndexValid)
     {
-        LOCK(cs_wallet);
+        int64 nStart = GetTimeMillis();
+        mapUnspent.clear();
+        for (int i = 0; i < UNSPENT_STATES; i++)
+            nUnspentCredit[i] = 0;
+        fUnspentIndexValid = true;
+        pindexUnspentTip = pindexBest;
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+            IndexUnspent((*it).first);
+        if (fDebug)
+            printf("UpdateUnspentIndex() : %"PRIszu" of %"PRIszu" wallet transactions unspent  %"PRI64d"ms\n",
+                   mapUnspent.size(), mapWallet.size(), GetTimeMillis() - nStart);
+        return;
     }
-    return nTotal;
+
+    if (pindexUnspentTip == pindexBest)
+        return;
+
+    // If the old tip is still in the main chain the chain only grew, and just
+    // the volatile entries need another look; after a reorg any might change
+    bool fReorg = (pindexUnspentTip && !pindexUnspentTip->IsInMainChain());
+    pindexUnspentTip = pindexBest;
+
+    vector<uint256> vUpdate;
+    for (map<uint256, CUnspentEntry>::const_iterator it = mapUnspent.begin(); it != mapUnspent.end(); ++it)
+        if (fReorg || (*it).second.fVolatile)
+            vUpdate.push_back((*it).first);
+    BOOST_FOREACH(const uint256& hash, vUpdate)
+        IndexUnspent(hash);
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateUnspentIndex();
+    return nUnspentCredit[UNSPENT_CONFIRMED];
+}
+
+int64 CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    UpdateUnspentIndex();
+    return nUnspentCredit[UNSPENT_UNCONFIRMED] + nUnspentCredit[UNSPENT_NONFINAL];
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    UpdateUnspentIndex();
+    return nUnspentCredit[UNSPENT_IMMATURE];
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -972,18 +1479,18 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentIndex();
+        for (map<uint256, CUnspentEntry>::const_iterator mi = mapUnspent.begin(); mi != mapUnspent.end(); ++mi)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
+            int nState = (*mi).second.nState;
+            if (nState == UNSPENT_NONFINAL || nState == UNSPENT_IMMATURE)
                 continue;
 
-            if (fOnlyConfirmed && !pcoin->IsConfirmed())
+            if (fOnlyConfirmed && nState != UNSPENT_CONFIRMED)
                 continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find((*mi).first);
+            const CWalletTx* pcoin = &(*it).second;
 
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) &&
@@ -995,7 +1502,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsigned int> > >vValue, int64 nTotalLower, int64 nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTotalLower, int64 nTargetValue,
                                   vector<char>& vfBest, int64& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1041,7 +1548,91 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+// Depth-first branch and bound search for a subset of vValue (sorted by
+// decreasing value) adding up to exactly nTargetValue, which needs no change.
+static bool ExactMatchSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                             vector<char>& vfBest)
+{
+    unsigned int nSize = vValue.size();
+
+    // vRemaining[i] is what all coins from i on add up to
+    vector<int64> vRemaining(nSize + 1, 0);
+    for (unsigned int i = nSize; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    vector<char> vfIncluded(nSize, false);
+    int64 nTotal = 0;
+    unsigned int i = 0;
+    for (unsigned int nTries = 0; nTries < COIN_SELECTION_BNB_MAX_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTotal < nTargetValue && nTotal + vRemaining[i] >= nTargetValue)
+        {
+            // go deeper, with coin i in
+            vfIncluded[i] = true;
+            nTotal += vValue[i].first;
+            i++;
+            continue;
+        }
+
+        // Overshot, or can't get there anymore: take out the last coin put
+        // in and carry on without it
+        while (i > 0 && !vfIncluded[i - 1])
+            i--;
+        if (i == 0)
+            return false;
+        i--;
+        vfIncluded[i] = false;
+        nTotal -= vValue[i].first;
+        i++;
+        // a coin of the same value in its place would just repeat this branch
+        while (i < nSize && vValue[i].first == vValue[i - 1].first)
+            i++;
+    }
+    return false;
+}
+
+// For wallets with very many coins: take coins from the highest value
+// buckets (by power of two) down until the target is covered, only sorting
+// the bucket that covers it. Linear in the number of coins.
+static void LargestFirstSubset(const vector<pair<int64, pair<const CWalletTx*,unsigned int> > >& vValue, int64 nTargetValue,
+                               vector<char>& vfBest, int64& nBest)
+{
+    vector<vector<pair<int64, unsigned int> > > vBuckets(64);
+    for (unsigned int i = 0; i < vValue.size(); i++)
+    {
+        int nBucket = 0;
+        for (int64 n = vValue[i].first; n > 1; n >>= 1)
+            nBucket++;
+        vBuckets[nBucket].push_back(make_pair(vValue[i].first, i));
+    }
+
+    vfBest.assign(vValue.size(), false);
+    nBest = 0;
+    for (int nBucket = 63; nBucket >= 0 && nBest < nTargetValue; nBucket--)
+    {
+        vector<pair<int64, unsigned int> >& vBucket = vBuckets[nBucket];
+        int64 nBucketTotal = 0;
+        for (unsigned int j = 0; j < vBucket.size(); j++)
+            nBucketTotal += vBucket[j].first;
+        if (nBest + nBucketTotal > nTargetValue)
+            sort(vBucket.rbegin(), vBucket.rend());
+        for (unsigned int j = 0; j < vBucket.size() && nBest < nTargetValue; j++)
+        {
+            vfBest[vBucket[j].second] = true;
+            nBest += vBucket[j].first;
+        }
+    }
+}
+
+bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1054,9 +1645,7 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
     vector<pair<int64, pair<const CWalletTx*,unsigned int> > > vValue;
     int64 nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1104,14 +1693,29 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     int64 nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (vValue.size() > COIN_SELECTION_SEARCH_MAX)
+    {
+        // Too many coins to search through under cs_wallet
+        LargestFirstSubset(vValue, nTargetValue, vfBest, nBest);
+    }
+    else
+    {
+        sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+
+        // An exact match saves the change output; failing that, solve subset
+        // sum by stochastic approximation
+        if (ExactMatchSubset(vValue, nTargetValue, vfBest))
+            nBest = nTargetValue;
+        else
+        {
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+            if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+                ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+        }
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1131,20 +1735,20 @@ bool CWallet::SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfThe
 
         //// debug print
         printf("SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                printf("%s ", FormatMoney(vValue[i].first).c_str());
+        if (setCoinsRet.size() > 100)
+            printf("%"PRIszu" coins ", setCoinsRet.size());
+        else
+            for (unsigned int i = 0; i < vValue.size(); i++)
+                if (vfBest[i])
+                    printf("%s ", FormatMoney(vValue[i].first).c_str());
         printf("total %s\n", FormatMoney(nBest).c_str());
     }
 
     return true;
 }
 
-bool CWallet::SelectCoins(int64 nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(int64 nTargetValue, const vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-    
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
@@ -1188,6 +1792,11 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // The candidates don't change while the fee is worked out
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl);
+            random_shuffle(vAvailableCoins.begin(), vAvailableCoins.end(), GetRandInt);
+
             nFeeRet = nTransactionFee;
             loop
             {
@@ -1212,7 +1821,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64 nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(nTotalValue, vAvailableCoins, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1289,13 +1898,15 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
                 // Sign
+                map<unsigned int, CScript> mapFromPubKey;
                 int nIn = 0;
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
-                    {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
-                    }
+                    mapFromPubKey[nIn++] = coin.first->vout[coin.second].scriptPubKey;
+                if (!SignSignatures(*this, mapFromPubKey, wtxNew))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
 
                 // Limit size
                 unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -1335,6 +1946,45 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, int64 nValue,
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strFailReason, coinControl);
 }
 
+// Record a transaction made by CreateTransaction in the wallet, and mark the
+// coins it spends
+void CWallet::AddSentTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
+{
+    // Take key pair from key pool so it won't be used again
+    reservekey.KeepKey();
+
+    // Add tx to wallet, because if it has change it's also ours,
+    // otherwise just for transaction history.
+    AddToWallet(wtxNew);
+
+    // Mark old coins as spent
+    BOOST_FOREACH(const CTxIn& txin, wtxNew.vin)
+    {
+        CWalletTx &coin = mapWallet[txin.prevout.hash];
+        coin.BindWallet(this);
+        coin.MarkSpent(txin.prevout.n);
+        coin.WriteToDisk();
+        IndexUnspent(txin.prevout.hash);
+        NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
+    }
+}
+
+bool CWallet::BroadcastSentTransaction(CWalletTx& wtxNew)
+{
+    // Track how many getdata requests our transaction gets
+    mapRequestCount[wtxNew.GetHash()] = 0;
+
+    // Broadcast
+    if (!wtxNew.AcceptToMemoryPool(true, false))
+    {
+        // This must not fail. The transaction has already been signed and recorded.
+        printf("CommitTransaction() : Error: Transaction not valid");
+        return false;
+    }
+    wtxNew.RelayWalletTransaction();
+    return true;
+}
+
 // Call after CreateTransaction unless you want to abort
 bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 {
@@ -1347,43 +1997,104 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
             // maybe makes sense; please don't do it anywhere else.
             CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
 
-            // Take key pair from key pool so it won't be used again
-            reservekey.KeepKey();
-
-            // Add tx to wallet, because if it has change it's also ours,
-            // otherwise just for transaction history.
-            AddToWallet(wtxNew);
-
-            // Mark old coins as spent
-            set<CWalletTx*> setCoins;
-            BOOST_FOREACH(const CTxIn& txin, wtxNew.vin)
-            {
-                CWalletTx &coin = mapWallet[txin.prevout.hash];
-                coin.BindWallet(this);
-                coin.MarkSpent(txin.prevout.n);
-                coin.WriteToDisk();
-                NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
-            }
+            AddSentTransaction(wtxNew, reservekey);
 
             if (fFileBacked)
                 delete pwalletdb;
         }
 
-        // Track how many getdata requests our transaction gets
-        mapRequestCount[wtxNew.GetHash()] = 0;
+        if (!BroadcastSentTransaction(wtxNew))
+            return false;
+    }
+    return true;
+}
 
-        // Broadcast
-        if (!wtxNew.AcceptToMemoryPool(true, false))
+bool CWallet::DeferTxWrite(const uint256& hash) const
+{
+    if (!fTxBatch)
+        return false;
+    setTxBatch.insert(hash);
+    return true;
+}
+
+bool CWallet::WriteTxBatch()
+{
+    std::set<uint256> setWrite;
+    setWrite.swap(setTxBatch);
+    if (!fFileBacked || setWrite.empty())
+        return true;
+
+    CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return error("WriteTxBatch() : TxnBegin failed");
+    BOOST_FOREACH(const uint256& hash, setWrite)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        if (!walletdb.WriteTx(hash, (*mi).second))
         {
-            // This must not fail. The transaction has already been signed and recorded.
-            printf("CommitTransaction() : Error: Transaction not valid");
-            return false;
+            walletdb.TxnAbort();
+            return error("WriteTxBatch() : writing %s failed", hash.ToString().c_str());
         }
-        wtxNew.RelayWalletTransaction();
     }
+    if (!walletdb.TxnCommit())
+        return error("WriteTxBatch() : TxnCommit failed");
     return true;
 }
 
+// Pay many recipients at once, at most nMaxOutputs of them per transaction.
+// The transactions are all recorded, and the wallet written out in one
+// database transaction, before any of them is broadcast. vwtxRet and
+// vstrErrorRet get an entry per transaction, the error empty if it was sent.
+// Returns false if the wallet file could not be written. The transactions
+// are broadcast all the same: they are in mapWallet with their coins marked
+// spent, and would be relayed by ResendWalletTransactions anyway.
+bool CWallet::SendBatch(const vector<pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, vector<CWalletTx>& vwtxRet,
+                        vector<string>& vstrErrorRet, unsigned int nMaxOutputs)
+{
+    vwtxRet.clear();
+    vstrErrorRet.clear();
+    if (nMaxOutputs == 0)
+        nMaxOutputs = vecSend.size();
+
+    LOCK2(cs_main, cs_wallet);
+    bool fWritten;
+    {
+        CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+
+        fTxBatch = true;
+        for (unsigned int nStart = 0; nStart < vecSend.size(); nStart += nMaxOutputs)
+        {
+            unsigned int nEnd = std::min((unsigned int)vecSend.size(), nStart + nMaxOutputs);
+            vector<pair<CScript, int64> > vecPart(vecSend.begin() + nStart, vecSend.begin() + nEnd);
+
+            vwtxRet.push_back(wtxTemplate);
+            vstrErrorRet.push_back("");
+            CWalletTx& wtx = vwtxRet.back();
+            CReserveKey reservekey(this);
+            int64 nFeeRequired = 0;
+            if (IsLocked())
+                vstrErrorRet.back() = _("Error: Wallet locked, unable to create transaction!");
+            else if (CreateTransaction(vecPart, wtx, reservekey, nFeeRequired, vstrErrorRet.back()))
+                AddSentTransaction(wtx, reservekey);
+            else if (vstrErrorRet.back().empty())
+                vstrErrorRet.back() = _("Transaction creation failed!");
+        }
+        fTxBatch = false;
+
+        fWritten = WriteTxBatch();
+        if (fFileBacked)
+            delete pwalletdb;
+    }
+
+    printf("SendBatch() : %"PRIszu" recipients in %"PRIszu" transactions\n", vecSend.size(), vwtxRet.size());
+    for (unsigned int i = 0; i < vwtxRet.size(); i++)
+        if (vstrErrorRet[i].empty() && !BroadcastSentTransaction(vwtxRet[i]))
+            vstrErrorRet[i] = _("Error: The transaction was rejected!");
+    return fWritten;
+}
+
 
 
 
@@ -1555,32 +2266,111 @@ bool CWallet::NewKeyPool()
     return true;
 }
 
-bool CWallet::TopUpKeyPool()
+// Add freshly generated keys to the wallet and the key pool, as long as the
+// pool is short of nTargetSize + 1, writing them all through one handle.
+// Returns false if the wallet got locked in the meantime.
+bool CWallet::AddKeyPoolKeys(const vector<CKey>& vKeys, const vector<CPubKey>& vPubKeys, unsigned int nTargetSize)
 {
-    {
-        LOCK(cs_wallet);
+    LOCK(cs_wallet);
 
-        if (IsLocked())
-            return false;
+    if (IsLocked())
+        return false;
 
-        CWalletDB walletdb(strWalletFile);
+    CWalletDB walletdb(strWalletFile);
+    pwalletdbKeyBatch = fFileBacked ? &walletdb : NULL;
 
-        // Top up key pool
-        unsigned int nTargetSize = max(GetArg("-keypool", 100), 0LL);
-        while (setKeyPool.size() < (nTargetSize + 1))
+    unsigned int nAdded = 0;
+    for (unsigned int i = 0; i < vKeys.size() && setKeyPool.size() < (nTargetSize + 1); i++)
+    {
+        // Compressed public keys were introduced in version 0.6.0
+        if (vKeys[i].IsCompressed())
+            SetMinVersion(FEATURE_COMPRPUBKEY, &walletdb);
+
+        int64 nEnd = 1;
+        if (!setKeyPool.empty())
+            nEnd = *(--setKeyPool.end()) + 1;
+        if (!AddKeyPubKey(vKeys[i], vPubKeys[i]) || !walletdb.WritePool(nEnd, CKeyPool(vPubKeys[i])))
         {
-            int64 nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            printf("keypool added key %"PRI64d", size=%"PRIszu"\n", nEnd, setKeyPool.size());
+            pwalletdbKeyBatch = NULL;
+            throw runtime_error("TopUpKeyPool() : writing generated key failed");
         }
+        setKeyPool.insert(nEnd);
+        nAdded++;
     }
+    pwalletdbKeyBatch = NULL;
+
+    if (nAdded)
+        printf("keypool added %u keys, size=%"PRIszu"\n", nAdded, setKeyPool.size());
     return true;
 }
 
+// Fill the key pool up to nSize keys (-keypool if 0), KEYPOOL_BATCH_SIZE at
+// a time. The keys are generated without holding cs_wallet, so when called
+// from a thread that doesn't hold it, the pool can be drawn from meanwhile.
+bool CWallet::TopUpKeyPool(unsigned int nSize)
+{
+    unsigned int nTargetSize = nSize ? nSize : max(GetArg("-keypool", 100), 0LL);
+    while (true)
+    {
+        unsigned int nMissing;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                return true;
+            nMissing = std::min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_BATCH_SIZE);
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+        }
+
+        RandAddSeedPerfmon();
+        vector<CKey> vKeys(nMissing);
+        vector<CPubKey> vPubKeys(nMissing);
+        for (unsigned int i = 0; i < nMissing; i++)
+        {
+            vKeys[i].MakeNewKey(fCompressed);
+            vPubKeys[i] = vKeys[i].GetPubKey();
+        }
+
+        if (!AddKeyPoolKeys(vKeys, vPubKeys, nTargetSize))
+            return false;
+    }
+}
+
+void CWallet::RequestKeyPoolTopUp()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolWorker);
+    fKeyPoolTopUpRequested = true;
+    condKeyPoolWorker.notify_one();
+}
+
+void CWallet::WaitForKeyPoolTopUpRequest()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolWorker);
+    while (!fKeyPoolTopUpRequested)
+        condKeyPoolWorker.wait(lock);
+    fKeyPoolTopUpRequested = false;
+}
+
+void ThreadKeyPoolWorker(CWallet* pwallet)
+{
+    // Make this thread recognisable as the key pool thread
+    RenameThread("xfuel-keypool");
+
+    while (true)
+    {
+        try {
+            pwallet->TopUpKeyPool();
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadKeyPoolWorker()");
+        }
+        pwallet->WaitForKeyPoolTopUpRequest();
+    }
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1588,8 +2378,10 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // ThreadKeyPoolWorker keeps the pool filled; only if it has run dry
+        // does the caller have to wait for a key to be made
+        if (!IsLocked() && setKeyPool.empty())
+            TopUpKeyPool(1);
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -1605,6 +2397,9 @@ void CWallet::ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool)
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
         assert(keypool.vchPubKey.IsValid());
         printf("keypool reserve %"PRI64d"\n", nIndex);
+
+        if (!IsLocked() && setKeyPool.size() <= (unsigned int)max(GetArg("-keypool", 100), 0LL))
+            RequestKeyPoolTopUp();
     }
 }
 
@@ -1685,9 +2480,9 @@ std::map<CTxDestination, int64> CWallet::GetAddressBalances()
 
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& walletEntry, mapWallet)
         {
-            CWalletTx *pcoin = &walletEntry.second;
+            const CWalletTx *pcoin = &walletEntry.second;
 
             if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
                 continue;
@@ -1724,7 +2519,7 @@ set< set<CTxDestination> > CWallet::GetAddressGroupings()
     set< set<CTxDestination> > groupings;
     set<CTxDestination> grouping;
 
-    BOOST_FOREACH(PAIRTYPE(uint256, CWalletTx) walletEntry, mapWallet)
+    BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& walletEntry, mapWallet)
     {
         CWalletTx *pcoin = &walletEntry.second;
 
@@ -36,6 +36,18 @@ enum WalletFeature
 };
 
 
+/** Most branches the exact-match coin selection explores before giving up */
+static const unsigned int COIN_SELECTION_BNB_MAX_TRIES = 100000;
+/** Above this many candidate coins, selection takes the largest coins first instead of searching for a best subset */
+static const unsigned int COIN_SELECTION_SEARCH_MAX = 1000;
+/** Number of keys the key pool is topped up by at a time, and written out together */
+static const unsigned int KEYPOOL_BATCH_SIZE = 100;
+/** Default for the most recipients SendBatch puts in one transaction */
+static const unsigned int SEND_BATCH_MAX_OUTPUTS = 500;
+
+/** Number of blocks a wallet rescan reads ahead and applies at a time */
+static const unsigned int RESCAN_BATCH_SIZE = 500;
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -69,7 +81,7 @@ public:
 class CWallet : public CCryptoKeyStore
 {
 private:
-    bool SelectCoins(int64 nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64 nTargetValue, const std::vector<COutput>& vAvailableCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet, const CCoinControl *coinControl=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -79,6 +91,54 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Index of the wallet transactions that still have unspent outputs of
+    // ours, with their credit cached per confirmation state, so balances and
+    // coin lists don't have to walk all of mapWallet. Entries are refreshed
+    // when their transaction changes; when the best chain moves only the
+    // entries that can change state are looked at again.
+    enum UnspentState
+    {
+        UNSPENT_CONFIRMED,
+        UNSPENT_UNCONFIRMED,
+        UNSPENT_NONFINAL,
+        UNSPENT_IMMATURE,
+        UNSPENT_STATES
+    };
+    struct CUnspentEntry
+    {
+        int nState;
+        int64 nCredit;
+        bool fVolatile; // may change state as the chain grows
+    };
+    mutable std::map<uint256, CUnspentEntry> mapUnspent;
+    mutable int64 nUnspentCredit[UNSPENT_STATES];
+    mutable bool fUnspentIndexValid;
+    mutable const CBlockIndex* pindexUnspentTip;
+
+    void IndexUnspent(const uint256& hash) const;
+    void UpdateUnspentIndex() const;
+
+    // While fTxBatch is set, wallet transactions to be written out are
+    // collected here and written in one database transaction by
+    // WriteTxBatch, instead of one by one
+    bool fTxBatch;
+    mutable std::set<uint256> setTxBatch;
+
+    bool WriteTxBatch();
+    void AddSentTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool BroadcastSentTransaction(CWalletTx& wtxNew);
+
+    // While set, new keys are written through this handle, so a batch of
+    // them added to the key pool is synced to disk once
+    CWalletDB* pwalletdbKeyBatch;
+
+    // ThreadKeyPoolWorker waits on this until the key pool runs low
+    boost::mutex mutexKeyPoolWorker;
+    boost::condition_variable condKeyPoolWorker;
+    bool fKeyPoolTopUpRequested;
+
+    bool AddKeyPoolKeys(const std::vector<CKey>& vKeys, const std::vector<CPubKey>& vPubKeys, unsigned int nTargetSize);
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -100,6 +160,16 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fUnspentIndexValid = false;
+        pindexUnspentTip = NULL;
+        fTxBatch = false;
+        pwalletdbKeyBatch = NULL;
+        fKeyPoolTopUpRequested = false;
+        fHistoryIndexValid = false;
+        pindexHistoryTip = NULL;
+        fRescanning = false;
+        nRescanStartHeight = nRescanHeight = nRescanStopHeight = nRescanFound = 0;
+        nRescanStartTime = 0;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -110,6 +180,16 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fUnspentIndexValid = false;
+        pindexUnspentTip = NULL;
+        fTxBatch = false;
+        pwalletdbKeyBatch = NULL;
+        fKeyPoolTopUpRequested = false;
+        fHistoryIndexValid = false;
+        pindexHistoryTip = NULL;
+        fRescanning = false;
+        nRescanStartHeight = nRescanHeight = nRescanStopHeight = nRescanFound = 0;
+        nRescanStartTime = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -122,11 +202,19 @@ public:
 
     std::set<COutPoint> setLockedCoins;
 
+    // progress of a running ScanForWalletTransactions, for getrescaninfo; requires cs_wallet
+    bool fRescanning;
+    int nRescanStartHeight;
+    int nRescanHeight;
+    int nRescanStopHeight;
+    int nRescanFound;
+    int64 nRescanStartTime;
+
     // check whether we are allowed to upgrade (or already support) to the named feature
     bool CanSupportFeature(enum WalletFeature wf) { return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
+    bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const;
     bool IsLockedCoin(uint256 hash, unsigned int n) const;
     void LockCoin(COutPoint& output);
     void UnlockCoin(COutPoint& output);
@@ -168,6 +256,48 @@ public:
      */
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
 
+    /** Page through the wallet's activity log, newest first
+        @param[in] strAccount    only items that may involve this account, "*" for all
+        @param[in] nBeforePos    only items ordered before this position
+        @param[in] nMax          maximum number of items to return
+        @return position to pass as nBeforePos for the next page, -1 once the log is exhausted
+        @warning Returned pointers are only valid while cs_wallet is held
+     */
+    int64 GetTxItemsBefore(const std::string& strAccount, int64 nBeforePos, unsigned int nMax, std::vector<TxPair>& vItemsRet);
+
+    /** Wallet transactions in blocks above nHeight, unconfirmed, or in blocks that left the main chain */
+    void GetTxsSinceHeight(int nHeight, std::vector<const CWalletTx*>& vRet);
+
+    /** Add an accounting entry to the history index once it has been written to the database */
+    void IndexAccountingEntry(const CAccountingEntry& acentry);
+
+    /** Amount received by an address of ours in final, non-coinbase transactions with at
+        least nMinDepth confirmations, looked up in the history index.
+        @param[out] nConfRet     fewest confirmations among the outputs counted, INT_MAX if none
+        @param[out] pvTxidsRet   if given, the transaction of each output counted
+        @param[in]  pscriptExact if given, only outputs with exactly this script count
+     */
+    int64 GetReceivedByDestination(const CTxDestination& address, int nMinDepth, int& nConfRet,
+                                   std::vector<uint256>* pvTxidsRet = NULL, const CScript* pscriptExact = NULL);
+
+private:
+    // Indexes over the wallet's history, so the list RPCs only touch the rows
+    // they return. Built on first use and kept up to date as transactions and
+    // accounting entries come in; requires cs_wallet.
+    bool fHistoryIndexValid;
+    const CBlockIndex* pindexHistoryTip;
+    TxItems wtxOrdered;                                             // everything, by nOrderPos
+    std::list<CAccountingEntry> laccentries;                        // the accounting entries in wtxOrdered
+    std::map<std::string, std::set<int64> > mapAccountOrder;        // sends from and moves of an account
+    std::map<CTxDestination, std::set<int64> > mapDestinationOrder; // receives to an address of ours
+    std::multimap<int, uint256> mapTxByHeight;                      // by height of their block, unconfirmed last
+    std::set<uint256> setTxOffChain;                                // in blocks that left the main chain
+
+    void UpdateHistoryIndex();
+    void IndexHistory(CWalletTx* pwtx);
+    void IndexHistory(CAccountingEntry* pacentry);
+
+public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
@@ -184,11 +314,16 @@ public:
     bool CreateTransaction(CScript scriptPubKey, int64 nValue,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool SendBatch(const std::vector<std::pair<CScript, int64> >& vecSend, const CWalletTx& wtxTemplate, std::vector<CWalletTx>& vwtxRet,
+                   std::vector<std::string>& vstrErrorRet, unsigned int nMaxOutputs=SEND_BATCH_MAX_OUTPUTS);
+    bool DeferTxWrite(const uint256& hash) const;
     std::string SendMoney(CScript scriptPubKey, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
     std::string SendMoneyToDestination(const CTxDestination &address, int64 nValue, CWalletTx& wtxNew, bool fAskFee=false);
 
     bool NewKeyPool();
-    bool TopUpKeyPool();
+    bool TopUpKeyPool(unsigned int nSize = 0);
+    void RequestKeyPoolTopUp();
+    void WaitForKeyPoolTopUpRequest();
     int64 AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64& nIndex, CKeyPool& keypool);
     void KeepKey(int64 nIndex);
@@ -859,5 +994,6 @@ private:
 };
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
+void ThreadKeyPoolWorker(CWallet* pwallet);
 
 #endif
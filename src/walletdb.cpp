@@ -7,6 +7,8 @@
 #include "wallet.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
@@ -21,6 +23,7 @@ static uint64 nAccountingEntryNumber = 0;
 bool CWalletDB::WriteName(const string& strAddress, const string& strName)
 {
     nWalletDBUpdated++;
+    SyncOnClose();
     return Write(make_pair(string("name"), strAddress), strName);
 }
 
@@ -182,11 +185,124 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
 }
 
 
+// The costly parts of reading "tx" and "key"/"wkey" records, which don't touch
+// the wallet, so LoadWallet can run them on several threads
+
+static bool DecodeWalletTx(const uint256& hash, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static bool DecodeKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    if (strType == "key")
+        ssValue >> pkey;
+    else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+    if (!key.SetPrivKey(pkey, vchPubKey.IsCompressed()))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    if (key.GetPubKey() != vchPubKey)
+    {
+        strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+        return false;
+    }
+    return true;
+}
+
+// A wallet.dat record, and what a worker thread decoded from it
+struct CWalletLoadRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+    bool fDecoded;
+    bool fDecodedOK;
+    string strErr;
+    int64 nDecodeMicros;
+
+    uint256 hash;
+    CWalletTx wtx;
+    bool fUpgraded;
+    CPubKey vchPubKey;
+    CKey key;
+
+    CWalletLoadRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+                          fDecoded(false), fDecodedOK(false), nDecodeMicros(0), fUpgraded(false) {}
+};
+
+static void DecodeLoadRecords(vector<CWalletLoadRecord>* pvRecords, unsigned int nFirst, unsigned int nStride)
+{
+    for (unsigned int i = nFirst; i < pvRecords->size(); i += nStride)
+    {
+        CWalletLoadRecord& rec = (*pvRecords)[i];
+        int64 nStart = GetTimeMicros();
+        try {
+            CDataStream ssKey(rec.ssKey);
+            ssKey >> rec.strType;
+            if (rec.strType == "tx")
+            {
+                ssKey >> rec.hash;
+                rec.fDecodedOK = DecodeWalletTx(rec.hash, rec.ssValue, rec.wtx, rec.fUpgraded, rec.strErr);
+                rec.fDecoded = true;
+            }
+            else if (rec.strType == "key" || rec.strType == "wkey")
+            {
+                rec.fDecodedOK = DecodeKey(rec.strType, ssKey, rec.ssValue, rec.vchPubKey, rec.key, rec.strErr);
+                rec.fDecoded = true;
+            }
+        } catch (...) {
+            rec.fDecoded = true;
+            rec.fDecodedOK = false;
+        }
+        rec.nDecodeMicros = GetTimeMicros() - nStart;
+    }
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
-             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr)
+             bool& fIsEncrypted,  bool& fAnyUnordered, string& strType, string& strErr,
+             CWalletLoadRecord* prec = NULL)
 {
+    bool fDecoded = prec && prec->fDecoded;
     try {
         // Unserialize
         // Taking advantage of the fact that pair serialization
@@ -203,9 +319,19 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             uint256 hash;
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            CValidationState state;
-            if (wtx.CheckTransaction(state) && (wtx.GetHash() == hash) && state.IsValid())
+            bool fOK;
+            bool fUpgraded = false;
+            if (fDecoded)
+            {
+                fOK = prec->fDecodedOK;
+                if (fOK)
+                    wtx = prec->wtx;
+                fUpgraded = prec->fUpgraded;
+                strErr = prec->strErr;
+            }
+            else
+                fOK = DecodeWalletTx(hash, ssValue, wtx, fUpgraded, strErr);
+            if (fOK)
                 wtx.BindWallet(pwallet);
             else
             {
@@ -213,25 +339,8 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
 
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
+            if (fUpgraded)
                 vWalletUpgrade.push_back(hash);
-            }
 
             if (wtx.nOrderPos == -1)
                 fAnyUnordered = true;
@@ -264,31 +373,17 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "key" || strType == "wkey")
         {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            if (strType == "key")
-                ssValue >> pkey;
-            else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-            if (!key.SetPrivKey(pkey, vchPubKey.IsCompressed()))
+            if (fDecoded)
             {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
-                return false;
+                strErr = prec->strErr;
+                if (!prec->fDecodedOK)
+                    return false;
+                vchPubKey = prec->vchPubKey;
+                key = prec->key;
             }
-            if (key.GetPubKey() != vchPubKey)
-            {
-                strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+            else if (!DecodeKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -396,42 +491,87 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
-        loop
+        // Records are read a batch at a time; transactions and keys in the
+        // batch are decoded by worker threads, then everything is added to
+        // the wallet in file order
+        unsigned int nThreads = std::max(1U, (unsigned int)boost::thread::hardware_concurrency());
+        int64 nReadMicros = 0, nDecodeMicros = 0;
+        map<string, pair<unsigned int, int64> > mapTypeStats; // records and microseconds per type
+        vector<CWalletLoadRecord> vRecords;
+        bool fMore = true;
+        while (fMore)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            // Read next records
+            int64 nStart = GetTimeMicros();
+            vRecords.clear();
+            vRecords.resize(WALLET_LOAD_BATCH_SIZE);
+            unsigned int nRecords = 0;
+            while (nRecords < vRecords.size())
+            {
+                int ret = ReadAtCursor(pcursor, vRecords[nRecords].ssKey, vRecords[nRecords].ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    fMore = false;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    printf("Error reading next record from wallet database\n");
+                    pcursor->close();
+                    return DB_CORRUPT;
+                }
+                nRecords++;
+            }
+            vRecords.resize(nRecords);
+            nReadMicros += GetTimeMicros() - nStart;
+
+            nStart = GetTimeMicros();
             {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                boost::thread_group threadGroup;
+                unsigned int nBatchThreads = std::min(nThreads, (nRecords + 99) / 100);
+                for (unsigned int i = 1; i < nBatchThreads; i++)
+                    threadGroup.create_thread(boost::bind(&DecodeLoadRecords, &vRecords, i, nBatchThreads));
+                DecodeLoadRecords(&vRecords, 0, std::max(1U, nBatchThreads));
+                threadGroup.join_all();
             }
+            nDecodeMicros += GetTimeMicros() - nStart;
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            BOOST_FOREACH(CWalletLoadRecord& rec, vRecords)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                int64 nApplyStart = GetTimeMicros();
+
+                // Try to be tolerant of single corrupt records:
+                string strType, strErr;
+                if (!ReadKeyValue(pwallet, rec.ssKey, rec.ssValue, nFileVersion,
+                                  vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr, &rec))
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!strErr.empty())
+                    printf("%s\n", strErr.c_str());
+
+                pair<unsigned int, int64>& stats = mapTypeStats[strType];
+                stats.first++;
+                stats.second += rec.nDecodeMicros + GetTimeMicros() - nApplyStart;
             }
-            if (!strErr.empty())
-                printf("%s\n", strErr.c_str());
         }
         pcursor->close();
+
+        printf("LoadWallet() : read %"PRI64d"ms, decode %"PRI64d"ms on up to %u threads\n",
+               nReadMicros / 1000, nDecodeMicros / 1000, nThreads);
+        for (map<string, pair<unsigned int, int64> >::iterator it = mapTypeStats.begin(); it != mapTypeStats.end(); ++it)
+            printf("LoadWallet() :   %-12s %8u records %8"PRI64d"ms\n", (*it).first.c_str(), (*it).second.first, (*it).second.second / 1000);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -475,15 +615,35 @@ void ThreadFlushWalletDB(const string& strFile)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
-        return;
+    bool fFlushWallet = GetBoolArg("-flushwallet", true);
+    int64 nSyncInterval = std::max((int64)1, GetArg("-walletsyncms", DEFAULT_WALLET_SYNC_MS));
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
+    unsigned int nLastSynced;
+    {
+        LOCK(bitdb.cs_db);
+        nLastSynced = bitdb.nWriteHandlesClosed;
+    }
     int64 nLastWalletUpdate = GetTime();
     while (true)
     {
-        MilliSleep(500);
+        MilliSleep(nSyncInterval);
+
+        // Group commit: one log sync for all the wallet writes since the last
+        unsigned int nClosed;
+        {
+            LOCK(bitdb.cs_db);
+            nClosed = bitdb.nWriteHandlesClosed;
+        }
+        if (nLastSynced != nClosed)
+        {
+            nLastSynced = nClosed;
+            bitdb.SyncLog();
+        }
+
+        if (!fFlushWallet)
+            continue;
 
         if (nLastSeen != nWalletDBUpdated)
         {
@@ -23,6 +23,9 @@ enum DBErrors
     DB_NEED_REWRITE
 };
 
+/** Number of wallet.dat records LoadWallet reads, then decodes in parallel, at a time */
+static const unsigned int WALLET_LOAD_BATCH_SIZE = 10000;
+
 /** Access to the wallet database (wallet.dat) */
 class CWalletDB : public CDB
 {
@@ -53,12 +56,14 @@ public:
     bool WriteKey(const CPubKey& vchPubKey, const CPrivKey& vchPrivKey)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         return Write(std::make_pair(std::string("key"), vchPubKey), vchPrivKey, false);
     }
 
     bool WriteCryptedKey(const CPubKey& vchPubKey, const std::vector<unsigned char>& vchCryptedSecret, bool fEraseUnencryptedKey = true)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         if (!Write(std::make_pair(std::string("ckey"), vchPubKey), vchCryptedSecret, false))
             return false;
         if (fEraseUnencryptedKey)
@@ -72,12 +77,14 @@ public:
     bool WriteMasterKey(unsigned int nID, const CMasterKey& kMasterKey)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         return Write(std::make_pair(std::string("mkey"), nID), kMasterKey, true);
     }
 
     bool WriteCScript(const uint160& hash, const CScript& redeemScript)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         return Write(std::make_pair(std::string("cscript"), hash), redeemScript, false);
     }
 
@@ -112,12 +119,14 @@ public:
     bool WritePool(int64 nPool, const CKeyPool& keypool)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         return Write(std::make_pair(std::string("pool"), nPool), keypool);
     }
 
     bool ErasePool(int64 nPool)
     {
         nWalletDBUpdated++;
+        SyncOnClose();
         return Erase(std::make_pair(std::string("pool"), nPool));
     }
 
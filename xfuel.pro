@@ -184,6 +184,7 @@ HEADERS += src/qt/xfuelgui.h \
     src/bloom.h \
     src/mruset.h \
     src/checkqueue.h \
+    src/prevector.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \